@@ -29,6 +29,14 @@
 #include <linux/i2c-dev.h>
 #include <linux/miscdevice.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/idr.h>
+#include <linux/of.h>
+#include <linux/version.h>
 #include <linux/mm.h>
 #include <linux/device.h>
 #include <linux/fs.h>
@@ -38,9 +46,25 @@
 #include <linux/input.h>
 #include <linux/regmap.h>
 #include <linux/sensors.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/seqlock.h>
+#include <linux/pm_runtime.h>
 #include <asm/uaccess.h>
 
 #include "mmc3416x.h"
+#include "sensor_poll.h"
+
+#define CREATE_TRACE_POINTS
+#include "mmc3416x_trace.h"
+
+/* ACCESS_ONCE is gone since 4.15, READ_ONCE only arrived in 3.19 */
+#ifndef READ_ONCE
+#define READ_ONCE(x)		ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val)	(ACCESS_ONCE(x) = (val))
+#endif
 
 #define MMC3416X_DELAY_TM_MS	10
 
@@ -48,17 +72,64 @@
 #define MMC3416X_DELAY_RESET_MS	75
 
 #define MMC3416X_RETRY_COUNT	10
+#define MMC3416X_READY_SLACK_US	200
 #define MMC3416X_DEFAULT_INTERVAL_MS	100
 #define MMC3416X_TIMEOUT_SET_MS	15000
+#define MMC3416X_AUTOSUSPEND_DELAY_MS	3000
+#define MMC3416X_HEARTBEAT_MS	1000
 
 #define MMC3416X_PRODUCT_ID	0x06
 
+/*
+ * One instance, see mmc3416x_legacy_node(), keeps the legacy names and
+ * handle, the others derive theirs from the bus address. The address never is 0 so these handles
+ * stay clear of the small per type ones.
+ */
+#define MMC3416X_HANDLE(nr, addr)	(SENSORS_MAGNETIC_FIELD_HANDLE | \
+					((nr) << 16) | ((addr) << 8))
+
+/* Calibration fixed point format, soft iron entries are Q16 */
+#define MMC3416X_CAL_SHIFT	16
+#define MMC3416X_CAL_ONE	(1 << MMC3416X_CAL_SHIFT)
+#define MMC3416X_CAL_SOFT_MAX	(4 * MMC3416X_CAL_ONE)
+#define MMC3416X_CAL_OFFSET_MAX	32768
+
+/* Oversampling limits, the ratio must be a power of two */
+#define MMC3416X_OVERSAMPLE_MAX	16
+#define MMC3416X_CIC_ORDER_MAX	2
+#define MMC3416X_IIR_SHIFT_MAX	8
+
+/* Software FIFO depth for batching, must be a power of two */
+#define MMC3416X_FIFO_SIZE	128
+#define MMC3416X_FIFO_MASK	(MMC3416X_FIFO_SIZE - 1)
+/* SYN_DROPPED, 6 axes, SYN_TIME_SEC/NSEC and SYN_REPORT at most */
+#define MMC3416X_EVENTS_PER_SAMPLE	10
+/* evdev client buffers hold this many packets, EVDEV_BUF_PACKETS */
+#define MMC3416X_EVDEV_BUF_PACKETS	8
+
+/* mmap sample ring, header page followed by the records */
+#define MMC3416X_RING_SAMPLES	1024
+#define MMC3416X_RING_MASK	(MMC3416X_RING_SAMPLES - 1)
+#define MMC3416X_RING_SIZE	(PAGE_SIZE + PAGE_ALIGN(MMC3416X_RING_SAMPLES * \
+				sizeof(struct mmc3416x_ring_sample)))
+
+/* per client queue of decimated samples, must be a power of two */
+#define MMC3416X_CLIENT_FIFO_SIZE	64
+#define MMC3416X_CLIENT_FIFO_MASK	(MMC3416X_CLIENT_FIFO_SIZE - 1)
+
 /* POWER SUPPLY VOLTAGE RANGE */
 #define MMC3416X_VDD_MIN_UV	2000000
 #define MMC3416X_VDD_MAX_UV	3300000
 #define MMC3416X_VIO_MIN_UV	1750000
 #define MMC3416X_VIO_MAX_UV	1950000
 
+/* SET/RESET maintenance states, sampling is paused unless idle */
+enum {
+	MMC3416X_SET_IDLE = 0,
+	MMC3416X_SET_REFILL,
+	MMC3416X_SET_SET,
+};
+
 enum {
 	OBVERSE_X_AXIS_FORWARD = 0,
 	OBVERSE_X_AXIS_RIGHTWARD,
@@ -93,19 +164,243 @@ static s8 mmc3416x_rotation_matrix[MMC3416X_DIR_COUNT][9] = {
 	[REVERSE_X_AXIS_LEFTWARD] = {-1, 0, 0, 0, 1, 0, 0, 0, -1},
 };
 
+struct mmc3416x_cm_rate {
+	unsigned int	interval_ms;
+	u8		ctrl;
+};
+
+/*
+ * Continuous measurement output rates, from the slowest to the fastest.
+ * interval_ms is the chip period rounded up, a rate is only usable when
+ * the chip produces a fresh sample at least once per poll interval.
+ */
+static const struct mmc3416x_cm_rate mmc3416x_cm_rates[] = {
+	{ 84, MMC3416X_CTRL_12HZ },
+	{ 40, MMC3416X_CTRL_25HZ },
+	{ 20, MMC3416X_CTRL_50HZ },
+};
+
+/*
+ * Output resolution modes, indexed by MMC3416X_BITS_*. Faster modes trade
+ * resolution for a shorter TM, min_delay_us keeps one TM per poll with
+ * some margin and is a whole number of ms for the poll timer.
+ */
+struct mmc3416x_mode {
+	const char	*name;
+	unsigned int	conv_us;
+	int		offset;
+	int		min_delay_us;
+	char		*resolution;
+	char		*max_range;
+};
+
+static const struct mmc3416x_mode mmc3416x_modes[] = {
+	[MMC3416X_BITS_SLOW_16] = {
+		.name		= "slow16",
+		.conv_us	= 7920,
+		.offset		= 32768,
+		.min_delay_us	= 10000,
+		.resolution	= "0.0488228125",
+		.max_range	= "1228.8",
+	},
+	[MMC3416X_BITS_FAST_16] = {
+		.name		= "fast16",
+		.conv_us	= 4080,
+		.offset		= 32768,
+		.min_delay_us	= 5000,
+		.resolution	= "0.0488228125",
+		.max_range	= "1228.8",
+	},
+	[MMC3416X_BITS_14] = {
+		.name		= "14bit",
+		.conv_us	= 2160,
+		.offset		= 8192,
+		.min_delay_us	= 3000,
+		.resolution	= "0.19529125",
+		.max_range	= "1228.8",
+	},
+};
+
 struct mmc3416x_vec {
 	int x;
 	int y;
 	int z;
 };
 
+struct mmc3416x_sample {
+	ktime_t			timestamp;
+	struct mmc3416x_vec	vec;
+	/* fused mode: the partner chip read in the same poll cycle */
+	struct mmc3416x_vec	partner;
+	bool			partner_valid;
+	/* samples were lost right before this one */
+	bool			gap;
+};
+
+/*
+ * Hard iron offsets in raw counts of the chip frame and the soft iron
+ * matrix in Q16, applied as soft * (raw - offset) before the rotation.
+ */
+struct mmc3416x_calib {
+	int	offset[3];
+	int	soft[9];
+};
+
+/*
+ * Mounting rotation and calibration folded into one Q16 transform,
+ * report = (m * raw + b) >> MMC3416X_CAL_SHIFT.
+ */
+struct mmc3416x_xform {
+	s32	m[9];
+	s64	b[3];
+};
+
+enum {
+	MMC3416X_FILTER_BOXCAR = 1,
+	MMC3416X_FILTER_CIC,
+};
+
+static const char * const mmc3416x_filter_modes[] = {
+	[MMC3416X_FILTER_BOXCAR] = "boxcar",
+	[MMC3416X_FILTER_CIC] = "cic",
+};
+
+/*
+ * Oversampling stage between the bus read and the transform. order is the
+ * number of CIC stages, one stage is a plain boxcar. The CIC registers
+ * are unsigned and rely on wrap around, the combs cancel it out.
+ * An optional one pole IIR low-pass runs on the decimated output.
+ */
+struct mmc3416x_filter {
+	unsigned int	oversample;
+	unsigned int	order;
+	unsigned int	iir_shift;
+	unsigned int	count;
+	unsigned int	warmup;
+	u64		integ[MMC3416X_CIC_ORDER_MAX][3];
+	u64		comb[MMC3416X_CIC_ORDER_MAX][3];
+	s64		iir[3];
+	bool		iir_primed;
+};
+
+struct mmc3416x_sched_stats {
+	u64			samples;
+	ktime_t			first;
+	ktime_t			last;
+	s64			jitter_min_ns;
+	s64			jitter_max_ns;
+	s64			jitter_sum_ns;
+	/* poll work time minus the driver's own sleeps */
+	u64			busy_sum_ns;
+	u64			busy_max_ns;
+};
+
+struct mmc3416x_bus_stats {
+	u64			reads;
+	u64			writes;
+	u64			samples;
+};
+
+/* Phases of a sample timed for the latency histograms */
+enum {
+	MMC3416X_PHASE_TM,
+	MMC3416X_PHASE_STATUS,
+	MMC3416X_PHASE_READ,
+	MMC3416X_PHASE_SET,
+	MMC3416X_PHASE_REPORT,
+	MMC3416X_PHASE_COUNT,
+};
+
+/* bucket i counts durations in [2^i, 2^(i+1)) us, bucket 0 also < 1 us */
+#define MMC3416X_HIST_BUCKETS	16
+
+struct mmc3416x_phase_stats {
+	u64			count;
+	u64			sum_ns;
+	u64			min_ns;
+	u64			max_ns;
+	u64			hist[MMC3416X_HIST_BUCKETS];
+};
+
+/* HAL samples let through and dropped by the deadband */
+struct mmc3416x_deadband_stats {
+	u64			reported;
+	u64			suppressed;
+	u64			heartbeats;
+};
+
+/* time from enable to the first reported sample */
+struct mmc3416x_ttfs_stats {
+	u64			count;
+	s64			last_ns;
+	s64			min_ns;
+	s64			max_ns;
+	s64			sum_ns;
+};
+
+enum {
+	MMC3416X_TTFS_WARM = 0,
+	MMC3416X_TTFS_COLD,
+	MMC3416X_TTFS_COUNT,
+};
+
+struct mmc3416x_data;
+
+/*
+ * One open file of the misc device. Once a rate is registered the client
+ * gets its own decimated stream through read()/poll(), otherwise poll()
+ * follows the shared mmap ring from the file's own ring_tail.
+ */
+struct mmc3416x_client {
+	struct list_head	node;
+	struct mmc3416x_data	*memsic;
+	unsigned int		interval_ms;
+	s64			next_ns;
+	struct mmc3416x_ring_sample fifo[MMC3416X_CLIENT_FIFO_SIZE];
+	unsigned int		head;
+	unsigned int		tail;
+	wait_queue_head_t	wait;
+	/* ring index this file has consumed up to */
+	u32			ring_tail;
+};
+
 struct mmc3416x_data {
 	struct mutex		ecompass_lock;
 	struct mutex		ops_lock;
-	struct workqueue_struct *data_wq;
-	struct delayed_work	dwork;
+	struct mutex		fifo_lock;
+	/* polled from the shared engine of the adapter */
+	struct sensor_poll_client poller;
+	bool			polling;
+
+	/* per instance names, see MMC3416X_HANDLE() */
+	int			id;
+	bool			legacy;
+	char			name[32];
+	char			cdev_name[32];
+	char			input_name[32];
+	char			input_phys[32];
+	bool			probed;
+	bool			verified;
+
+	/* keep CM running across a system suspend, see suspend_batch */
+	bool			suspend_batch;
+	bool			suspend_batched;
+	u8			suspend_ctrl;
+	bool			gap_pending;
+
+	/*
+	 * Fused pair: the primary reads its partner in its own poll cycle
+	 * and asks it for fused_interval through the partner's ops_lock.
+	 */
+	struct mmc3416x_data	*partner;
+	struct mmc3416x_data	*fused_primary;
+	unsigned int		fused_interval;
+	struct delayed_work	set_dwork;
 	struct sensors_classdev	cdev;
+	/* latest reported sample, readable without locks through last_seq */
+	seqcount_t		last_seq;
 	struct mmc3416x_vec	last;
+	ktime_t			last_ts;
 
 	struct i2c_client	*i2c;
 	struct input_dev	*idev;
@@ -114,13 +409,96 @@ struct mmc3416x_data {
 	struct regmap		*regmap;
 
 	int			dir;
+	/* calib is owned by ops_lock, xform is read by the poll work */
+	struct mmc3416x_calib	calib;
+	seqcount_t		xform_seq;
+	struct mmc3416x_xform	xform;
 	int			auto_report;
 	int			enable;
+	/* hardware rate, the fastest of hal_interval and the clients */
 	int			poll_interval;
+	int			hal_interval;
+	s64			hal_next_ns;
+	/* deadband in output counts, 0 reports every sample */
+	unsigned int		deadband;
+	unsigned int		heartbeat_ms;
+	struct mmc3416x_sample	hal_last;
+	bool			hal_last_valid;
+	struct mmc3416x_deadband_stats dband;
+	/*
+	 * Someone wants the chip measuring and holds a runtime PM reference
+	 * for it. Written under ops_lock and ecompass_lock both, so the
+	 * ioctl paths and the SET work may test it under ecompass_lock.
+	 */
+	bool			hw_active;
 	int			power_enabled;
-	unsigned long		timeout;
+	int			autosuspend_delay;
+	bool			cold_start;
+	int			set_state;
+	/* a SET or RESET asked for by an ioctl, run by the state machine */
+	u8			set_cmd;
+	bool			set_requested;
+	int			set_rc;
+	struct completion	set_done;
+	/* measurement mode, 0 for TM or CM with its frequency */
+	u8			ctrl;
+	/* configuration bits kept in every CTRL write, MMC3416X_CTRL_NOBOOST */
+	u8			ctrl_cfg;
+	u8			bits;
+	ktime_t			tm_time;
+	/* when the sample last fetched was measured, in boottime */
+	ktime_t			sample_time;
+	/* time slept waiting for conversions, under ecompass_lock */
+	u64			sleep_ns;
+
+	/* batched samples waiting to be reported, protected by fifo_lock */
+	struct mmc3416x_sample	fifo[MMC3416X_FIFO_SIZE];
+	unsigned int		fifo_head;
+	unsigned int		fifo_tail;
+	unsigned int		max_latency;
+	int			flush_count;
+
+	struct mmc3416x_sched_stats sched;
+	struct mmc3416x_bus_stats bus;
+	struct mmc3416x_ttfs_stats ttfs[MMC3416X_TTFS_COUNT];
+	/* bus phases are updated under ecompass_lock, REPORT by the poll */
+	struct mmc3416x_phase_stats phase[MMC3416X_PHASE_COUNT];
+	u64			status_retries[MMC3416X_RETRY_COUNT + 1];
+	ktime_t			enable_time;
+	int			ttfs_pending;
+	struct dentry		*debugfs;
+
+	/*
+	 * Open files and ring mappings hold a reference, the data and the
+	 * ring outlive an unbind until the last of them is gone. File
+	 * operations that reach the chip hold unbind_sem for reading, the
+	 * unbind sets gone and then takes it for writing.
+	 */
+	struct kref		kref;
+	struct rw_semaphore	unbind_sem;
+	bool			gone;
+
+	/* shared memory sample ring exported through miscdev */
+	struct miscdevice	miscdev;
+	struct mmc3416x_ring_header *ring;
+	struct mmc3416x_ring_sample *ring_data;
+	/* producer index, the mapped hdr->head is only a copy of it */
+	u32			ring_head;
+	wait_queue_head_t	ring_wait;
+
+	/* rate clients of the misc device, protected by client_lock */
+	struct list_head	clients;
+	spinlock_t		client_lock;
+
+	/* configured under ops_lock, filter_lock orders it with the poll */
+	spinlock_t		filter_lock;
+	struct mmc3416x_filter	filter;
+	/* output interval min_delay holds oversampling to, 0 when none */
+	unsigned int		oversample_limit_ms;
 };
 
+static DEFINE_IDA(mmc3416x_ida);
+
 static struct sensors_classdev sensors_cdev = {
 	.name = "mmc3416x-mag",
 	.vendor = "MEMSIC, Inc",
@@ -132,197 +510,2387 @@ static struct sensors_classdev sensors_cdev = {
 	.sensor_power = "0.35",
 	.min_delay = 10000,
 	.max_delay = 10000,
-	.fifo_reserved_event_count = 0,
-	.fifo_max_event_count = 0,
+	.fifo_reserved_event_count = MMC3416X_FIFO_SIZE,
+	.fifo_max_event_count = MMC3416X_FIFO_SIZE,
 	.enabled = 0,
 	.delay_msec = MMC3416X_DEFAULT_INTERVAL_MS,
 	.sensors_enable = NULL,
 	.sensors_poll_delay = NULL,
+	.sensors_set_latency = NULL,
+	.sensors_flush = NULL,
 };
 
-static int mmc3416x_read_xyz(struct mmc3416x_data *memsic,
-		struct mmc3416x_vec *vec)
+static u8 mmc3416x_select_ctrl(unsigned int interval_ms)
 {
-	int count = 0;
-	unsigned char data[6];
-	unsigned int status;
-	struct mmc3416x_vec tmp;
-	int rc = 0;
+	int i;
 
-	mutex_lock(&memsic->ecompass_lock);
+	for (i = 0; i < ARRAY_SIZE(mmc3416x_cm_rates); i++) {
+		if (mmc3416x_cm_rates[i].interval_ms <= interval_ms)
+			return MMC3416X_CTRL_CM | mmc3416x_cm_rates[i].ctrl;
+	}
 
-	/* mmc3416x need to be set periodly to avoid overflow */
-	if (time_after(jiffies, memsic->timeout)) {
-		rc = regmap_write(memsic->regmap, MMC3416X_REG_CTRL,
-				MMC3416X_CTRL_REFILL);
-		if (rc) {
-			dev_err(&memsic->i2c->dev, "write reg %d failed at %d.(%d)\n",
-					MMC3416X_REG_CTRL, __LINE__, rc);
-			goto exit;
-		}
+	/* Faster than continuous mode can go, trigger every sample */
+	return 0;
+}
 
-		/* Time from refill cap to SET */
-		msleep(MMC3416X_DELAY_SET_MS);
+static void mmc3416x_phase_account(struct mmc3416x_data *memsic, int phase,
+		ktime_t start)
+{
+	struct mmc3416x_phase_stats *st = &memsic->phase[phase];
+	u64 delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+	u32 us = min_t(u64, delta / NSEC_PER_USEC, U32_MAX);
+	int bucket = us ? ilog2(us) : 0;
+
+	if (!st->count || delta < st->min_ns)
+		st->min_ns = delta;
+	if (delta > st->max_ns)
+		st->max_ns = delta;
+	st->sum_ns += delta;
+	st->count++;
+	st->hist[min(bucket, MMC3416X_HIST_BUCKETS - 1)]++;
+}
 
-		rc = regmap_write(memsic->regmap, MMC3416X_REG_CTRL,
-				MMC3416X_CTRL_SET);
-		if (rc) {
-			dev_err(&memsic->i2c->dev, "write reg %d failed at %d.(%d)\n",
-					MMC3416X_REG_CTRL, __LINE__, rc);
-			goto exit;
-		}
+/*
+ * CTRL mixes the measurement configuration with self clearing command
+ * bits. Only the configuration lives in the register cache, commands
+ * bypass it and always go to the bus, carrying the configuration bits
+ * that are not part of the measurement mode.
+ * Must be called with ecompass_lock held.
+ */
+static int mmc3416x_ctrl_cmd(struct mmc3416x_data *memsic, u8 cmd)
+{
+	int rc;
 
-		/* Wait time to complete SET/RESET */
-		usleep_range(1000, 1500);
-		memsic->timeout = jiffies +
-			msecs_to_jiffies(MMC3416X_TIMEOUT_SET_MS);
+	regcache_cache_bypass(memsic->regmap, true);
+	rc = regmap_write(memsic->regmap, MMC3416X_REG_CTRL,
+			cmd | memsic->ctrl_cfg);
+	regcache_cache_bypass(memsic->regmap, false);
 
-		dev_dbg(&memsic->i2c->dev, "mmc3416x reset is done\n");
+	return rc;
+}
 
-		/* Re-send the TM command */
-		rc = regmap_write(memsic->regmap, MMC3416X_REG_CTRL,
-				MMC3416X_CTRL_TM);
-		if (rc) {
-			dev_err(&memsic->i2c->dev, "write reg %d failed at %d.(%d)\n",
-					MMC3416X_REG_CTRL, __LINE__, rc);
-			goto exit;
-		}
-	}
+/* Must be called with ecompass_lock held */
+static int mmc3416x_trigger(struct mmc3416x_data *memsic)
+{
+	ktime_t start = ktime_get();
+	int rc;
+
+	rc = mmc3416x_ctrl_cmd(memsic, MMC3416X_CTRL_TM);
+	mmc3416x_phase_account(memsic, MMC3416X_PHASE_TM, start);
+	trace_mmc3416x_tm(&memsic->i2c->dev, rc);
+	if (!rc)
+		memsic->tm_time = ktime_get_boottime();
+
+	return rc;
+}
+
+/* Must be called with ecompass_lock held */
+static int mmc3416x_start_measure(struct mmc3416x_data *memsic)
+{
+	int rc;
+
+	/* elided when the chip already runs this configuration */
+	rc = regmap_update_bits(memsic->regmap, MMC3416X_REG_CTRL, 0xff,
+			memsic->ctrl | memsic->ctrl_cfg);
+	if (rc || memsic->ctrl)
+		return rc;
+
+	return mmc3416x_trigger(memsic);
+}
+
+/*
+ * Same as mmc3416x_start_measure() but always rewrites the configuration,
+ * used after a command left the chip in a state the cache does not know.
+ * Must be called with ecompass_lock held.
+ */
+static int mmc3416x_restart_measure(struct mmc3416x_data *memsic)
+{
+	if (!memsic->ctrl)
+		return mmc3416x_trigger(memsic);
+
+	return regmap_write(memsic->regmap, MMC3416X_REG_CTRL,
+			memsic->ctrl | memsic->ctrl_cfg);
+}
+
+/* usleep_range() that keeps the sleep out of the busy time statistics */
+static void mmc3416x_sleep(struct mmc3416x_data *memsic,
+		unsigned long min_us, unsigned long max_us)
+{
+	ktime_t start = ktime_get();
+
+	usleep_range(min_us, max_us);
+	memsic->sleep_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/* Sleep once until the pending TM is predicted to be complete */
+static void mmc3416x_wait_predicted(struct mmc3416x_data *memsic)
+{
+	ktime_t ready = ktime_add_us(memsic->tm_time,
+			mmc3416x_modes[memsic->bits].conv_us);
+	s64 remain = ktime_us_delta(ready, ktime_get_boottime());
+
+	if (remain > 0)
+		mmc3416x_sleep(memsic, remain,
+				remain + MMC3416X_READY_SLACK_US);
+}
+
+/* Fallback when the prediction was too early, poll the status register */
+static int mmc3416x_wait_status(struct mmc3416x_data *memsic)
+{
+	int count = 0;
+	unsigned int status;
+	int rc;
 
 	/* Read MD */
 	rc = regmap_read(memsic->regmap, MMC3416X_REG_DS, &status);
 	if (rc) {
 		dev_err(&memsic->i2c->dev, "read reg %d failed at %d.(%d)\n",
 				MMC3416X_REG_DS, __LINE__, rc);
-		goto exit;
-
+		return rc;
 	}
 
-	while ((!(status & 0x01)) && (count < MMC3416X_RETRY_COUNT)) {
+	while ((!(status & MMC3416X_DS_MEAS_DONE)) &&
+			(count < MMC3416X_RETRY_COUNT)) {
+		/* Wait more time to get valid data */
+		mmc3416x_sleep(memsic, 1000, 1500);
+		count++;
+
 		/* Read MD again*/
 		rc = regmap_read(memsic->regmap, MMC3416X_REG_DS, &status);
 		if (rc) {
 			dev_err(&memsic->i2c->dev, "read reg %d failed at %d.(%d)\n",
 					MMC3416X_REG_DS, __LINE__, rc);
-			goto exit;
-
+			return rc;
 		}
-
-		/* Wait more time to get valid data */
-		usleep_range(1000, 1500);
-		count++;
 	}
 
-	if (count >= MMC3416X_RETRY_COUNT) {
+	memsic->status_retries[count]++;
+	trace_mmc3416x_data_ready(&memsic->i2c->dev, status, count);
+
+	if (!(status & MMC3416X_DS_MEAS_DONE)) {
 		dev_err(&memsic->i2c->dev, "TM not work!!");
-		rc = -EFAULT;
-		goto exit;
+		return -EFAULT;
 	}
 
-	/* read xyz raw data */
-	rc = regmap_bulk_read(memsic->regmap, MMC3416X_REG_DATA, data, 6);
+	return 0;
+}
+
+/* Must be called with ecompass_lock held */
+static int mmc3416x_fetch_xyz(struct mmc3416x_data *memsic,
+		struct mmc3416x_vec *vec)
+{
+	/* XYZ data registers followed by the status register */
+	unsigned char data[7];
+	struct mmc3416x_vec tmp;
+	bool triggered = !(memsic->ctrl & MMC3416X_CTRL_CM);
+	int offset = mmc3416x_modes[memsic->bits].offset;
+	ktime_t start;
+	int rc;
+
+	/* In continuous mode the data registers always hold the latest sample */
+	if (triggered)
+		mmc3416x_wait_predicted(memsic);
+
+	/*
+	 * A TM converts right after it is issued, stamp the sample at the
+	 * middle of the conversion. Continuous mode only tells it is the
+	 * latest one, stamp it when the transfer starts.
+	 */
+	if (triggered)
+		memsic->sample_time = ktime_add_us(memsic->tm_time,
+				mmc3416x_modes[memsic->bits].conv_us / 2);
+	else
+		memsic->sample_time = ktime_get_boottime();
+
+	/* read xyz raw data and status in one transfer */
+	start = ktime_get();
+	rc = regmap_bulk_read(memsic->regmap, MMC3416X_REG_DATA, data,
+			sizeof(data));
+	mmc3416x_phase_account(memsic, MMC3416X_PHASE_READ, start);
 	if (rc) {
 		dev_err(&memsic->i2c->dev, "read reg %d failed at %d.(%d)\n",
-				MMC3416X_REG_DS, __LINE__, rc);
-		goto exit;
+				MMC3416X_REG_DATA, __LINE__, rc);
+		trace_mmc3416x_read(&memsic->i2c->dev, 0, 0, 0, rc);
+		return rc;
+	}
+
+	if (triggered && (data[6] & MMC3416X_DS_MEAS_DONE)) {
+		trace_mmc3416x_data_ready(&memsic->i2c->dev, data[6], 0);
+	} else if (triggered) {
+		start = ktime_get();
+		rc = mmc3416x_wait_status(memsic);
+		mmc3416x_phase_account(memsic, MMC3416X_PHASE_STATUS, start);
+		if (rc)
+			return rc;
+
+		start = ktime_get();
+		rc = regmap_bulk_read(memsic->regmap, MMC3416X_REG_DATA,
+				data, 6);
+		mmc3416x_phase_account(memsic, MMC3416X_PHASE_READ, start);
+		if (rc) {
+			dev_err(&memsic->i2c->dev, "read reg %d failed at %d.(%d)\n",
+					MMC3416X_REG_DATA, __LINE__, rc);
+			trace_mmc3416x_read(&memsic->i2c->dev, 0, 0, 0, rc);
+			return rc;
+		}
 	}
 
-	tmp.x = (((u8)data[1]) << 8 | (u8)data[0]) - 32768;
-	tmp.y = (((u8)data[3]) << 8 | (u8)data[2]) - 32768;
-	tmp.z = (((u8)data[5]) << 8 | (u8)data[4]) - 32768;
+	tmp.x = (((u8)data[1]) << 8 | (u8)data[0]) - offset;
+	tmp.y = (((u8)data[3]) << 8 | (u8)data[2]) - offset;
+	tmp.z = (((u8)data[5]) << 8 | (u8)data[4]) - offset;
 
-	dev_dbg(&memsic->i2c->dev, "raw data:%d %d %d %d %d %d",
-			data[0], data[1], data[2], data[3], data[4], data[5]);
-	dev_dbg(&memsic->i2c->dev, "raw x:%d y:%d z:%d\n", tmp.x, tmp.y, tmp.z);
+	trace_mmc3416x_read(&memsic->i2c->dev, tmp.x, tmp.y, tmp.z, 0);
 
 	vec->x = tmp.x;
 	vec->y = tmp.y;
 	vec->z = -tmp.z;
+	memsic->bus.samples++;
 
-exit:
-	/* send TM cmd before read */
-	if (regmap_write(memsic->regmap, MMC3416X_REG_CTRL, MMC3416X_CTRL_TM)) {
+	return 0;
+}
+
+static int mmc3416x_read_xyz(struct mmc3416x_data *memsic,
+		struct mmc3416x_vec *vec, ktime_t *timestamp)
+{
+	int rc;
+
+	mutex_lock(&memsic->ecompass_lock);
+
+	/*
+	 * The SET pulse is in progress, skip this sample instead of
+	 * waiting. The refill before it leaves the measurement running.
+	 */
+	if (memsic->set_state == MMC3416X_SET_SET) {
+		rc = -EAGAIN;
+		goto out;
+	}
+
+	rc = mmc3416x_fetch_xyz(memsic, vec);
+	*timestamp = memsic->sample_time;
+
+	/* send TM cmd before read, not needed in continuous mode */
+	if (!(memsic->ctrl & MMC3416X_CTRL_CM) && mmc3416x_trigger(memsic)) {
 		dev_warn(&memsic->i2c->dev, "write reg %d failed at %d.(%d)\n",
 				MMC3416X_REG_CTRL, __LINE__, rc);
 	}
 
+out:
 	mutex_unlock(&memsic->ecompass_lock);
 	return rc;
 }
 
-static void mmc3416x_poll(struct work_struct *work)
+/*
+ * Take a measurement newer than the call for ioctl users while nothing
+ * polls the chip. In triggered mode a TM is issued now, in continuous mode
+ * wait one chip period, with ecompass_lock dropped meanwhile.
+ */
+static int mmc3416x_measure(struct mmc3416x_data *memsic,
+		struct mmc3416x_vec *vec, ktime_t *timestamp)
+{
+	unsigned int wait_ms = 0;
+	int rc;
+	int i;
+
+	mutex_lock(&memsic->ecompass_lock);
+	for (i = 0; i < ARRAY_SIZE(mmc3416x_cm_rates); i++) {
+		if ((MMC3416X_CTRL_CM | mmc3416x_cm_rates[i].ctrl) ==
+				memsic->ctrl)
+			wait_ms = mmc3416x_cm_rates[i].interval_ms;
+	}
+	mutex_unlock(&memsic->ecompass_lock);
+
+	if (wait_ms)
+		msleep(wait_ms);
+
+	mutex_lock(&memsic->ecompass_lock);
+
+	/* only a started sensor, the autosuspend delay may keep it powered */
+	if (!memsic->hw_active) {
+		rc = -ENODEV;
+		goto out;
+	}
+
+	if (memsic->set_state == MMC3416X_SET_SET) {
+		rc = -EBUSY;
+		goto out;
+	}
+
+	if (memsic->ctrl & MMC3416X_CTRL_CM) {
+		rc = mmc3416x_fetch_xyz(memsic, vec);
+		goto out;
+	}
+
+	rc = mmc3416x_trigger(memsic);
+	if (rc)
+		goto out;
+
+	rc = mmc3416x_fetch_xyz(memsic, vec);
+
+	/* keep a TM pending for the poll path as mmc3416x_read_xyz does */
+	if (mmc3416x_trigger(memsic))
+		dev_warn(&memsic->i2c->dev, "write reg %d failed at %d.\n",
+				MMC3416X_REG_CTRL, __LINE__);
+
+out:
+	*timestamp = memsic->sample_time;
+	mutex_unlock(&memsic->ecompass_lock);
+	return rc;
+}
+
+/*
+ * mmc3416x need to be set periodly to avoid overflow. The REFILL, SET and
+ * measurement restart are done one step per work run so that the poll
+ * path never waits for the capacitor to charge. The REFILL carries the
+ * measurement mode, so sampling goes on while the capacitor charges and
+ * only the millisecond of the SET pulse is skipped.
+ */
+/* Must be called with ecompass_lock held */
+static void mmc3416x_set_complete(struct mmc3416x_data *memsic, int rc)
+{
+	memsic->set_cmd = MMC3416X_CTRL_SET;
+	if (!memsic->set_requested)
+		return;
+
+	memsic->set_requested = false;
+	memsic->set_rc = rc;
+	complete(&memsic->set_done);
+}
+
+static void mmc3416x_set_work(struct work_struct *work)
 {
-	int ret;
-	s8 *tmp;
-	struct mmc3416x_vec vec;
-	struct mmc3416x_vec report;
 	struct mmc3416x_data *memsic = container_of((struct delayed_work *)work,
-			struct mmc3416x_data, dwork);
-	ktime_t timestamp;
+			struct mmc3416x_data, set_dwork);
+	unsigned long delay;
+	ktime_t start;
+	int rc;
+
+	mutex_lock(&memsic->ecompass_lock);
+
+	/* stopped meanwhile, the chip may already be powered down */
+	if (!memsic->hw_active) {
+		memsic->set_state = MMC3416X_SET_IDLE;
+		mmc3416x_set_complete(memsic, -ENODEV);
+		mutex_unlock(&memsic->ecompass_lock);
+		return;
+	}
+
+	start = ktime_get();
+
+	switch (memsic->set_state) {
+	case MMC3416X_SET_IDLE:
+		/* keep continuous mode running through the charge */
+		rc = mmc3416x_ctrl_cmd(memsic,
+				MMC3416X_CTRL_REFILL | memsic->ctrl);
+		memsic->set_state = MMC3416X_SET_REFILL;
+		/* Time from refill cap to SET/RESET */
+		delay = msecs_to_jiffies(memsic->set_cmd == MMC3416X_CTRL_SET ?
+				MMC3416X_DELAY_SET_MS : MMC3416X_DELAY_RESET_MS);
+		break;
+	case MMC3416X_SET_REFILL:
+		rc = mmc3416x_ctrl_cmd(memsic, memsic->set_cmd);
+		memsic->set_state = MMC3416X_SET_SET;
+		/* Wait time to complete SET/RESET */
+		delay = msecs_to_jiffies(1);
+		break;
+	default:
+		/* SET clears the CTRL register, restart the measurement */
+		rc = mmc3416x_restart_measure(memsic);
+		memsic->set_state = MMC3416X_SET_IDLE;
+		delay = msecs_to_jiffies(MMC3416X_TIMEOUT_SET_MS);
+		break;
+	}
+
+	trace_mmc3416x_set(&memsic->i2c->dev, memsic->set_state, rc);
+
+	if (rc) {
+		dev_err(&memsic->i2c->dev, "write reg %d failed at state %d.(%d)\n",
+				MMC3416X_REG_CTRL, memsic->set_state, rc);
+		/* Leave the chip measuring and try again next period */
+		mmc3416x_restart_measure(memsic);
+		memsic->set_state = MMC3416X_SET_IDLE;
+		delay = msecs_to_jiffies(MMC3416X_TIMEOUT_SET_MS);
+	}
+
+	if (memsic->set_state == MMC3416X_SET_IDLE)
+		mmc3416x_set_complete(memsic, rc);
+
+	/* one sample per step, the waits between steps are not counted */
+	mmc3416x_phase_account(memsic, MMC3416X_PHASE_SET, start);
+	mutex_unlock(&memsic->ecompass_lock);
+
+	queue_delayed_work(system_freezable_wq, &memsic->set_dwork, delay);
+}
+
+static void mmc3416x_set_stop(struct mmc3416x_data *memsic)
+{
+	cancel_delayed_work_sync(&memsic->set_dwork);
+
+	mutex_lock(&memsic->ecompass_lock);
+	memsic->set_state = MMC3416X_SET_IDLE;
+	mmc3416x_set_complete(memsic, -ENODEV);
+	mutex_unlock(&memsic->ecompass_lock);
+}
+
+static void mmc3416x_report(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample)
+{
+	/* tell the HAL the stream was interrupted before this sample */
+	if (sample->gap)
+		input_event(memsic->idev, EV_SYN, SYN_DROPPED, 0);
+
+	input_report_abs(memsic->idev, ABS_X, sample->vec.x);
+	input_report_abs(memsic->idev, ABS_Y, sample->vec.y);
+	input_report_abs(memsic->idev, ABS_Z, sample->vec.z);
+	if (sample->partner_valid) {
+		input_report_abs(memsic->idev, ABS_RX, sample->partner.x);
+		input_report_abs(memsic->idev, ABS_RY, sample->partner.y);
+		input_report_abs(memsic->idev, ABS_RZ, sample->partner.z);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+	/* the event time itself, input_set_timestamp() wants monotonic */
+	input_set_timestamp(memsic->idev, ktime_sub(sample->timestamp,
+			ktime_sub(ktime_get_boottime(), ktime_get())));
+#else
+	input_event(memsic->idev,
+			EV_SYN, SYN_TIME_SEC,
+			ktime_to_timespec(sample->timestamp).tv_sec);
+	input_event(memsic->idev,
+		EV_SYN, SYN_TIME_NSEC,
+		ktime_to_timespec(sample->timestamp).tv_nsec);
+#endif
+	input_sync(memsic->idev);
+}
+
+/* Must be called with fifo_lock held */
+static void mmc3416x_fifo_drain(struct mmc3416x_data *memsic)
+{
+	while (memsic->fifo_tail != memsic->fifo_head) {
+		mmc3416x_report(memsic,
+			&memsic->fifo[memsic->fifo_tail & MMC3416X_FIFO_MASK]);
+		memsic->fifo_tail++;
+	}
+}
+
+/*
+ * Queue a sample and report the whole batch in one burst when the FIFO is
+ * full or the oldest sample would exceed max_latency by the next poll.
+ * Returns false when the HAL stream is disabled and the sample is dropped.
+ */
+static bool mmc3416x_fifo_push(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample)
+{
+	struct mmc3416x_sample *oldest;
+	bool queued = false;
+
+	mutex_lock(&memsic->fifo_lock);
+
+	/* the hardware may keep running for misc device clients */
+	if (!memsic->enable)
+		goto exit;
+
+	queued = true;
+	if (!memsic->max_latency) {
+		mmc3416x_report(memsic, sample);
+		goto exit;
+	}
+
+	memsic->fifo[memsic->fifo_head & MMC3416X_FIFO_MASK] = *sample;
+	memsic->fifo_head++;
+
+	oldest = &memsic->fifo[memsic->fifo_tail & MMC3416X_FIFO_MASK];
+	if (memsic->fifo_head - memsic->fifo_tail >= MMC3416X_FIFO_SIZE ||
+		ktime_to_ms(ktime_sub(sample->timestamp, oldest->timestamp)) +
+		memsic->hal_interval > memsic->max_latency)
+		mmc3416x_fifo_drain(memsic);
+
+exit:
+	mutex_unlock(&memsic->fifo_lock);
+	return queued;
+}
+
+/*
+ * Decide whether a hardware sample at ts belongs to a stream running at
+ * interval_ms. Samples up to half a hardware period early are accepted so
+ * scheduling jitter does not skip a slot, and the schedule advances from
+ * the previous slot so the average rate stays exact.
+ */
+static bool mmc3416x_decimate(struct mmc3416x_data *memsic, s64 *next_ns,
+		unsigned int interval_ms, ktime_t ts)
+{
+	s64 now = ktime_to_ns(ts);
+	s64 slack = (s64)memsic->poll_interval * memsic->filter.oversample *
+		NSEC_PER_MSEC / 2;
+
+	if (now < *next_ns - slack)
+		return false;
+
+	*next_ns += (s64)interval_ms * NSEC_PER_MSEC;
+	/* resync after a gap instead of bursting to catch up */
+	if (*next_ns < now)
+		*next_ns = now + (s64)interval_ms * NSEC_PER_MSEC;
+
+	return true;
+}
+
+static void mmc3416x_clients_push(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample)
+{
+	struct mmc3416x_client *client;
+	struct mmc3416x_ring_sample *rs;
+
+	spin_lock(&memsic->client_lock);
+	list_for_each_entry(client, &memsic->clients, node) {
+		if (!client->interval_ms ||
+			!mmc3416x_decimate(memsic, &client->next_ns,
+				client->interval_ms, sample->timestamp))
+			continue;
+
+		rs = &client->fifo[client->head & MMC3416X_CLIENT_FIFO_MASK];
+		rs->timestamp = ktime_to_ns(sample->timestamp);
+		rs->x = sample->vec.x;
+		rs->y = sample->vec.y;
+		rs->z = sample->vec.z;
+		rs->flags = sample->gap ? MMC3416X_SAMPLE_GAP : 0;
+		WRITE_ONCE(client->head, client->head + 1);
+
+		/* a slow reader loses its oldest samples */
+		if (client->head - client->tail > MMC3416X_CLIENT_FIFO_SIZE)
+			WRITE_ONCE(client->tail,
+				client->head - MMC3416X_CLIENT_FIFO_SIZE);
+
+		wake_up_interruptible(&client->wait);
+	}
+	spin_unlock(&memsic->client_lock);
+}
+
+static void mmc3416x_calib_reset(struct mmc3416x_calib *calib)
+{
+	memset(calib, 0, sizeof(*calib));
+	calib->soft[0] = MMC3416X_CAL_ONE;
+	calib->soft[4] = MMC3416X_CAL_ONE;
+	calib->soft[8] = MMC3416X_CAL_ONE;
+}
+
+/*
+ * Rebuild the fused transform after dir or the calibration changed.
+ * Writers are serialized by ops_lock, or run before the poll work exists.
+ */
+static void mmc3416x_update_xform(struct mmc3416x_data *memsic)
+{
+	s8 *rot = &mmc3416x_rotation_matrix[memsic->dir][0];
+	struct mmc3416x_calib *calib = &memsic->calib;
+	struct mmc3416x_xform xf;
+	int i, j;
+
+	/* m = rot * soft, b = -m * offset */
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++)
+			xf.m[i * 3 + j] = rot[i * 3] * calib->soft[j] +
+				rot[i * 3 + 1] * calib->soft[3 + j] +
+				rot[i * 3 + 2] * calib->soft[6 + j];
+
+		xf.b[i] = -((s64)xf.m[i * 3] * calib->offset[0] +
+			(s64)xf.m[i * 3 + 1] * calib->offset[1] +
+			(s64)xf.m[i * 3 + 2] * calib->offset[2]);
+	}
+
+	preempt_disable();
+	write_seqcount_begin(&memsic->xform_seq);
+	memsic->xform = xf;
+	write_seqcount_end(&memsic->xform_seq);
+	preempt_enable();
+}
+
+static int mmc3416x_xform_row(const s32 *m, s64 b, struct mmc3416x_vec *vec)
+{
+	s64 acc = (s64)m[0] * vec->x + (s64)m[1] * vec->y +
+		(s64)m[2] * vec->z + b;
+
+	/* round to nearest, exact for the identity calibration */
+	return (acc + (1 << (MMC3416X_CAL_SHIFT - 1))) >> MMC3416X_CAL_SHIFT;
+}
+
+static void mmc3416x_transform(struct mmc3416x_data *memsic,
+		struct mmc3416x_vec *vec, struct mmc3416x_vec *report)
+{
+	struct mmc3416x_xform *xf = &memsic->xform;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&memsic->xform_seq);
+		report->x = mmc3416x_xform_row(&xf->m[0], xf->b[0], vec);
+		report->y = mmc3416x_xform_row(&xf->m[3], xf->b[1], vec);
+		report->z = mmc3416x_xform_row(&xf->m[6], xf->b[2], vec);
+	} while (read_seqcount_retry(&memsic->xform_seq, seq));
+}
+
+/* The poll work is the only writer of the latest sample */
+static void mmc3416x_publish_last(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample)
+{
+	/* a preempted writer would make readers spin */
+	preempt_disable();
+	write_seqcount_begin(&memsic->last_seq);
+	memsic->last = sample->vec;
+	memsic->last_ts = sample->timestamp;
+	write_seqcount_end(&memsic->last_seq);
+	preempt_enable();
+}
+
+static void mmc3416x_read_last(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&memsic->last_seq);
+		sample->vec = memsic->last;
+		sample->timestamp = memsic->last_ts;
+	} while (read_seqcount_retry(&memsic->last_seq, seq));
+}
+
+/*
+ * Publish a sample to the mmap ring. The poll work is the only producer,
+ * the record is written before the head index that makes it visible.
+ * The index is never read back from the mapped header.
+ */
+static void mmc3416x_ring_push(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample, u32 flags)
+{
+	struct mmc3416x_ring_header *hdr = memsic->ring;
+	struct mmc3416x_ring_sample *rs;
+	u32 head = memsic->ring_head;
+
+	rs = &memsic->ring_data[head & MMC3416X_RING_MASK];
+	rs->timestamp = ktime_to_ns(sample->timestamp);
+	rs->x = sample->vec.x;
+	rs->y = sample->vec.y;
+	rs->z = sample->vec.z;
+	rs->flags = flags;
+
+	smp_wmb();
+	WRITE_ONCE(memsic->ring_head, head + 1);
+	WRITE_ONCE(hdr->head, head + 1);
+
+	wake_up_interruptible(&memsic->ring_wait);
+}
+
+static void mmc3416x_sched_account(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_sched_stats *st = &memsic->sched;
+	ktime_t now = ktime_get_boottime();
+	s64 jitter = ktime_to_ns(ktime_sub(now, memsic->poller.deadline));
+
+	if (!st->samples) {
+		st->first = now;
+		st->jitter_min_ns = jitter;
+		st->jitter_max_ns = jitter;
+	}
+
+	st->jitter_min_ns = min(st->jitter_min_ns, jitter);
+	st->jitter_max_ns = max(st->jitter_max_ns, jitter);
+	st->jitter_sum_ns += jitter;
+	st->last = now;
+	st->samples++;
+}
+
+static void mmc3416x_ttfs_account(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_ttfs_stats *st =
+		&memsic->ttfs[memsic->ttfs_pending - 1];
+	s64 delta = ktime_to_ns(ktime_sub(ktime_get_boottime(),
+				memsic->enable_time));
+
+	if (!st->count || delta < st->min_ns)
+		st->min_ns = delta;
+	if (delta > st->max_ns)
+		st->max_ns = delta;
+	st->last_ns = delta;
+	st->sum_ns += delta;
+	st->count++;
+
+	memsic->ttfs_pending = 0;
+}
+
+/*
+ * Drop a HAL sample that stays within the deadband of the last reported
+ * one on every axis, unless heartbeat_ms passed since that report.
+ */
+static bool mmc3416x_suppress(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample)
+{
+	struct mmc3416x_sample *last = &memsic->hal_last;
+	unsigned int deadband = memsic->deadband;
+	unsigned int heartbeat_ms = memsic->heartbeat_ms;
+
+	if (deadband && memsic->hal_last_valid && !sample->gap &&
+			abs(sample->vec.x - last->vec.x) <= deadband &&
+			abs(sample->vec.y - last->vec.y) <= deadband &&
+			abs(sample->vec.z - last->vec.z) <= deadband) {
+		if (!heartbeat_ms || ktime_to_ms(ktime_sub(sample->timestamp,
+					last->timestamp)) < heartbeat_ms) {
+			memsic->dband.suppressed++;
+			return true;
+		}
+		memsic->dband.heartbeats++;
+	}
+
+	*last = *sample;
+	memsic->hal_last_valid = true;
+	memsic->dband.reported++;
+
+	return false;
+}
+
+/* Must be called with filter_lock held */
+static void mmc3416x_filter_reset(struct mmc3416x_filter *f)
+{
+	f->count = 0;
+	/* the first order - 1 outputs still hold the previous windows */
+	f->warmup = f->order - 1;
+	memset(f->integ, 0, sizeof(f->integ));
+	memset(f->comb, 0, sizeof(f->comb));
+	f->iir_primed = false;
+}
+
+/*
+ * Feed one hardware sample, returns true with the filtered value in vec
+ * once every oversample inputs. Must be called with filter_lock held.
+ */
+static bool mmc3416x_filter_step(struct mmc3416x_filter *f,
+		struct mmc3416x_vec *vec)
+{
+	int in[3] = { vec->x, vec->y, vec->z };
+	int out[3];
+	unsigned int shift = f->order * ilog2(f->oversample);
+	u64 v, d;
+	int i, k;
+
+	for (i = 0; i < 3; i++) {
+		v = (s64)in[i];
+		for (k = 0; k < f->order; k++) {
+			f->integ[k][i] += v;
+			v = f->integ[k][i];
+		}
+	}
+
+	if (++f->count < f->oversample)
+		return false;
+	f->count = 0;
+
+	for (i = 0; i < 3; i++) {
+		v = f->integ[f->order - 1][i];
+		for (k = 0; k < f->order; k++) {
+			d = v - f->comb[k][i];
+			f->comb[k][i] = v;
+			v = d;
+		}
+		/* the gain is oversample ^ order */
+		out[i] = (s64)v >> shift;
+	}
+
+	if (f->warmup) {
+		f->warmup--;
+		return false;
+	}
+
+	if (f->iir_shift) {
+		for (i = 0; i < 3; i++) {
+			if (!f->iir_primed)
+				f->iir[i] = (s64)out[i] << f->iir_shift;
+			else
+				f->iir[i] += out[i] - (f->iir[i] >> f->iir_shift);
+			out[i] = f->iir[i] >> f->iir_shift;
+		}
+		f->iir_primed = true;
+	}
+
+	vec->x = out[0];
+	vec->y = out[1];
+	vec->z = out[2];
+
+	return true;
+}
+
+/*
+ * Read the fused partner right after this chip so both samples come from
+ * the same poll cycle. The partner's own transform applies.
+ */
+static void mmc3416x_read_partner(struct mmc3416x_data *memsic,
+		struct mmc3416x_sample *sample)
+{
+	struct mmc3416x_data *partner = memsic->partner;
+	struct mmc3416x_vec vec;
+	ktime_t timestamp;
+
+	sample->partner_valid = false;
+	if (!partner)
+		return;
+
+	if (mmc3416x_read_xyz(partner, &vec, &timestamp))
+		return;
+
+	mmc3416x_transform(partner, &vec, &sample->partner);
+	sample->partner_valid = true;
+}
+
+static void mmc3416x_poll_sample(struct mmc3416x_data *memsic)
+{
+	int ret;
+	struct mmc3416x_vec vec;
+	/* the hardware sample that completed the filter window */
+	struct mmc3416x_vec raw;
+	struct mmc3416x_sample report;
+	unsigned int delay;
+	ktime_t timestamp;
+	ktime_t start;
+	bool ready;
+
+	vec.x = vec.y = vec.z = 0;
+
+	ret = mmc3416x_read_xyz(memsic, &vec, &timestamp);
+	if (ret) {
+		if (ret != -EAGAIN)
+			dev_warn(&memsic->i2c->dev, "read xyz failed\n");
+		/* let consumers see the hole left by a SET or a failed read */
+		memsic->gap_pending = true;
+		return;
+	}
+
+	raw = vec;
+	spin_lock(&memsic->filter_lock);
+	ready = mmc3416x_filter_step(&memsic->filter, &vec);
+	/* group delay of the CIC, in half hardware periods */
+	delay = memsic->filter.order * (memsic->filter.oversample - 1);
+	spin_unlock(&memsic->filter_lock);
+	if (!ready)
+		return;
+
+	start = ktime_get();
+	mmc3416x_transform(memsic, &vec, &report.vec);
+	mmc3416x_read_partner(memsic, &report);
+	/* stamp the filtered sample at the middle of its window */
+	report.timestamp = ktime_sub_ns(timestamp,
+			(u64)delay * memsic->poll_interval * NSEC_PER_MSEC / 2);
+	report.gap = memsic->gap_pending;
+	memsic->gap_pending = false;
+	trace_mmc3416x_report(&memsic->i2c->dev, raw.x, raw.y, raw.z,
+			report.vec.x, report.vec.y, report.vec.z,
+			ktime_to_ns(report.timestamp));
+	mmc3416x_publish_last(memsic, &report);
+	mmc3416x_ring_push(memsic, &report,
+			report.gap ? MMC3416X_SAMPLE_GAP : 0);
+	mmc3416x_clients_push(memsic, &report);
+
+	if (mmc3416x_decimate(memsic, &memsic->hal_next_ns,
+				memsic->hal_interval, report.timestamp) &&
+			!mmc3416x_suppress(memsic, &report) &&
+			mmc3416x_fifo_push(memsic, &report) &&
+			memsic->ttfs_pending)
+		mmc3416x_ttfs_account(memsic);
+
+	mmc3416x_phase_account(memsic, MMC3416X_PHASE_REPORT, start);
+}
+
+static void mmc3416x_poll(struct sensor_poll_client *poller)
+{
+	struct mmc3416x_data *memsic = container_of(poller,
+			struct mmc3416x_data, poller);
+	struct mmc3416x_sched_stats *st = &memsic->sched;
+	ktime_t start;
+	s64 busy;
+
+	mmc3416x_sched_account(memsic);
+
+	start = ktime_get();
+	memsic->sleep_ns = 0;
+	mmc3416x_poll_sample(memsic);
+
+	/*
+	 * An upper bound of the CPU time, i2c transfers that sleep for
+	 * their completion are still counted.
+	 */
+	busy = ktime_to_ns(ktime_sub(ktime_get(), start)) - memsic->sleep_ns;
+	if (busy > 0) {
+		st->busy_sum_ns += busy;
+		st->busy_max_ns = max_t(u64, st->busy_max_ns, busy);
+	}
+}
+
+static void mmc3416x_sched_start(struct mmc3416x_data *memsic)
+{
+	memset(&memsic->sched, 0, sizeof(memsic->sched));
+	sensor_poll_start(&memsic->poller, memsic->poll_interval);
+}
+
+static void mmc3416x_sched_stop(struct mmc3416x_data *memsic)
+{
+	sensor_poll_stop(&memsic->poller);
+}
+
+/* Must be called with ops_lock held */
+static int mmc3416x_hw_start(struct mmc3416x_data *memsic)
+{
+	int rc;
+
+	/* a no-op while the autosuspend delay keeps the chip powered */
+	rc = pm_runtime_get_sync(&memsic->i2c->dev);
+	if (rc < 0) {
+		dev_err(&memsic->i2c->dev, "Power up failed\n");
+		pm_runtime_put_noidle(&memsic->i2c->dev);
+		return rc;
+	}
+
+	spin_lock(&memsic->filter_lock);
+	mmc3416x_filter_reset(&memsic->filter);
+	spin_unlock(&memsic->filter_lock);
+
+	/* pick the measurement mode matching the poll interval */
+	mutex_lock(&memsic->ecompass_lock);
+	memsic->ctrl = mmc3416x_select_ctrl(memsic->poll_interval);
+	rc = mmc3416x_start_measure(memsic);
+	if (rc) {
+		mutex_unlock(&memsic->ecompass_lock);
+		dev_err(&memsic->i2c->dev, "write reg %d failed.(%d)\n",
+				MMC3416X_REG_CTRL, rc);
+		pm_runtime_put_autosuspend(&memsic->i2c->dev);
+		return rc;
+	}
+	memsic->hw_active = true;
+
+	/*
+	 * SET the chip right away after a power cycle, a chip that
+	 * stayed powered keeps its SET cadence.
+	 */
+	queue_delayed_work(system_freezable_wq, &memsic->set_dwork,
+			memsic->cold_start ? 0 :
+			msecs_to_jiffies(MMC3416X_TIMEOUT_SET_MS));
+	memsic->cold_start = false;
+	mutex_unlock(&memsic->ecompass_lock);
+
+	trace_mmc3416x_enable(&memsic->i2c->dev, 1, memsic->poll_interval);
+
+	return 0;
+}
+
+/* Must be called with ops_lock held */
+static void mmc3416x_hw_stop(struct mmc3416x_data *memsic)
+{
+	if (memsic->polling)
+		mmc3416x_sched_stop(memsic);
+	memsic->polling = false;
+
+	/* no ioctl may queue a SET on the chip from now on */
+	mutex_lock(&memsic->ecompass_lock);
+	memsic->hw_active = false;
+	mutex_unlock(&memsic->ecompass_lock);
+	mmc3416x_set_stop(memsic);
+	trace_mmc3416x_enable(&memsic->i2c->dev, 0, 0);
+
+	/* power is only cut once the autosuspend delay expires */
+	pm_runtime_mark_last_busy(&memsic->i2c->dev);
+	pm_runtime_put_autosuspend(&memsic->i2c->dev);
+}
+
+static void mmc3416x_fused_update(struct mmc3416x_data *memsic);
+
+/*
+ * Fastest interval the HAL and the misc device clients ask for, 0 when
+ * none of them wants samples.
+ */
+static unsigned int mmc3416x_stream_interval(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_client *client;
+	unsigned int interval = 0;
+
+	if (memsic->enable)
+		interval = memsic->hal_interval;
+
+	spin_lock(&memsic->client_lock);
+	list_for_each_entry(client, &memsic->clients, node) {
+		if (client->interval_ms &&
+			(!interval || client->interval_ms < interval))
+			interval = client->interval_ms;
+	}
+	spin_unlock(&memsic->client_lock);
+
+	return interval;
+}
+
+/*
+ * Run the hardware at the fastest rate anyone asked for, or stop it when
+ * neither the HAL, a misc device client nor a fused primary wants samples.
+ * Each stream is decimated back to its own rate in mmc3416x_poll(), a
+ * chip only read by its fused primary is not polled on its own.
+ * Must be called with ops_lock held.
+ */
+static int mmc3416x_update_hw(struct mmc3416x_data *memsic)
+{
+	unsigned int interval = mmc3416x_stream_interval(memsic);
+	unsigned int min_ms = memsic->cdev.min_delay / USEC_PER_MSEC;
+	unsigned int limit_ms;
+	bool changed;
+	bool poll;
+	u8 ctrl;
+	int rc = 0;
+
+	/* oversampling runs the chip faster than any stream */
+	if (interval) {
+		interval = max(interval / memsic->filter.oversample, 1U);
+		limit_ms = interval < min_ms && memsic->filter.oversample > 1 ?
+			min_ms * memsic->filter.oversample : 0;
+		/* only when the limit changes, not on every rate change */
+		if (limit_ms && limit_ms != memsic->oversample_limit_ms)
+			dev_warn(&memsic->i2c->dev,
+				"oversample %u limits output to every %u ms\n",
+				memsic->filter.oversample, limit_ms);
+		memsic->oversample_limit_ms = limit_ms;
+	}
+
+	poll = memsic->auto_report && interval;
+
+	if (memsic->fused_interval &&
+		(!interval || memsic->fused_interval < interval))
+		interval = memsic->fused_interval;
+
+	/* the resolution mode may have raised min_delay since */
+	if (interval && interval < min_ms)
+		interval = min_ms;
+
+	if (!interval) {
+		if (memsic->hw_active)
+			mmc3416x_hw_stop(memsic);
+		goto exit;
+	}
+
+	changed = interval != memsic->poll_interval;
+
+	if (!memsic->hw_active) {
+		memsic->poll_interval = interval;
+		rc = mmc3416x_hw_start(memsic);
+		if (rc)
+			return rc;
+		goto sched;
+	}
+
+	if (!changed)
+		goto sched;
+
+	memsic->poll_interval = interval;
+	trace_mmc3416x_enable(&memsic->i2c->dev, 1, interval);
+
+	spin_lock(&memsic->filter_lock);
+	mmc3416x_filter_reset(&memsic->filter);
+	spin_unlock(&memsic->filter_lock);
+
+	ctrl = mmc3416x_select_ctrl(interval);
+	mutex_lock(&memsic->ecompass_lock);
+	if (ctrl != memsic->ctrl) {
+		memsic->ctrl = ctrl;
+		/* a SET pulse restarts with the new ctrl when done */
+		if (memsic->set_state != MMC3416X_SET_SET)
+			rc = mmc3416x_start_measure(memsic);
+		if (rc)
+			dev_err(&memsic->i2c->dev,
+				"write reg %d failed.(%d)\n",
+				MMC3416X_REG_CTRL, rc);
+	}
+	mutex_unlock(&memsic->ecompass_lock);
+
+sched:
+	/* (re)start the deadline grid at the current period */
+	if (poll && (changed || !memsic->polling))
+		mmc3416x_sched_start(memsic);
+	else if (!poll && memsic->polling)
+		mmc3416x_sched_stop(memsic);
+	memsic->polling = poll;
+
+exit:
+	mmc3416x_fused_update(memsic);
+	return rc;
+}
+
+/* Let the fused partner follow the rate this chip is polled at */
+static void mmc3416x_fused_update(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_data *partner = memsic->partner;
+	unsigned int interval = memsic->polling ? memsic->poll_interval : 0;
+
+	if (!partner)
+		return;
+
+	mutex_lock_nested(&partner->ops_lock, SINGLE_DEPTH_NESTING);
+	if (partner->fused_interval != interval) {
+		partner->fused_interval = interval;
+		mmc3416x_update_hw(partner);
+	}
+	mutex_unlock(&partner->ops_lock);
+}
+
+/*
+ * Switch the output resolution mode. BITS is written through the cache so
+ * a powered down chip picks it up at the next regcache_sync().
+ * Must be called with ops_lock held.
+ */
+static int mmc3416x_set_bits(struct mmc3416x_data *memsic, unsigned int bits)
+{
+	const struct mmc3416x_mode *mode;
+	int rc;
+
+	if (bits >= ARRAY_SIZE(mmc3416x_modes))
+		return -EINVAL;
+
+	mode = &mmc3416x_modes[bits];
+
+	mutex_lock(&memsic->ecompass_lock);
+	rc = regmap_write(memsic->regmap, MMC3416X_REG_BITS, bits);
+	if (rc) {
+		dev_err(&memsic->i2c->dev, "write reg %d failed.(%d)\n",
+				MMC3416X_REG_BITS, rc);
+		goto out;
+	}
+
+	memsic->bits = bits;
+	memsic->cdev.min_delay = mode->min_delay_us;
+	memsic->cdev.resolution = mode->resolution;
+	memsic->cdev.max_range = mode->max_range;
+
+	/* a TM in flight was started with the old conversion time */
+	if (memsic->hw_active && memsic->set_state != MMC3416X_SET_SET)
+		rc = mmc3416x_restart_measure(memsic);
+
+out:
+	mutex_unlock(&memsic->ecompass_lock);
+	if (rc)
+		return rc;
+
+	/* the running rate may now be below min_delay */
+	return mmc3416x_update_hw(memsic);
+}
+
+static int mmc3416x_sched_show(struct seq_file *s, void *unused)
+{
+	struct mmc3416x_data *memsic = s->private;
+	struct mmc3416x_sched_stats *st = &memsic->sched;
+	s64 span = ktime_to_ns(ktime_sub(st->last, st->first));
+	u64 rate = 0;
+	s64 avg = 0;
+
+	/* achieved rate in mHz over the samples seen since (re)start */
+	if (st->samples > 1 && span > 0)
+		rate = div64_u64((st->samples - 1) * 1000ULL * NSEC_PER_SEC,
+				span);
+	if (st->samples)
+		avg = div64_s64(st->jitter_sum_ns, st->samples);
+
+	seq_printf(s, "period_ms: %d\n", memsic->poll_interval);
+	seq_printf(s, "samples: %llu\n", st->samples);
+	seq_printf(s, "overruns: %llu\n", memsic->poller.overruns);
+	seq_printf(s, "rate_mhz: %llu\n", rate);
+	seq_printf(s, "jitter_us: min %lld max %lld avg %lld\n",
+			div64_s64(st->jitter_min_ns, NSEC_PER_USEC),
+			div64_s64(st->jitter_max_ns, NSEC_PER_USEC),
+			div64_s64(avg, NSEC_PER_USEC));
+	seq_printf(s, "busy_us: max %llu avg %llu\n",
+			div64_u64(st->busy_max_ns, NSEC_PER_USEC),
+			st->samples ? div64_u64(div64_u64(st->busy_sum_ns,
+				st->samples), NSEC_PER_USEC) : 0);
+
+	return 0;
+}
+
+static int mmc3416x_sched_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc3416x_sched_show, inode->i_private);
+}
+
+static const struct file_operations mmc3416x_sched_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mmc3416x_sched_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int mmc3416x_bus_show(struct seq_file *s, void *unused)
+{
+	struct mmc3416x_data *memsic = s->private;
+	struct mmc3416x_bus_stats *st = &memsic->bus;
+	u64 per_sample = 0;
+
+	/* bus transactions per sample, in thousandths */
+	if (st->samples)
+		per_sample = div64_u64((st->reads + st->writes) * 1000,
+				st->samples);
+
+	seq_printf(s, "reads: %llu\n", st->reads);
+	seq_printf(s, "writes: %llu\n", st->writes);
+	seq_printf(s, "samples: %llu\n", st->samples);
+	seq_printf(s, "xfers_per_sample_milli: %llu\n", per_sample);
+
+	return 0;
+}
+
+static int mmc3416x_bus_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc3416x_bus_show, inode->i_private);
+}
+
+static const struct file_operations mmc3416x_bus_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mmc3416x_bus_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int mmc3416x_ttfs_show(struct seq_file *s, void *unused)
+{
+	static const char * const names[] = {
+		[MMC3416X_TTFS_WARM] = "warm",
+		[MMC3416X_TTFS_COLD] = "cold",
+	};
+	struct mmc3416x_data *memsic = s->private;
+	struct mmc3416x_ttfs_stats *st;
+	int i;
+
+	for (i = 0; i < MMC3416X_TTFS_COUNT; i++) {
+		st = &memsic->ttfs[i];
+		seq_printf(s, "%s: count %llu last_us %lld min_us %lld max_us %lld avg_us %lld\n",
+				names[i], st->count,
+				div64_s64(st->last_ns, NSEC_PER_USEC),
+				div64_s64(st->min_ns, NSEC_PER_USEC),
+				div64_s64(st->max_ns, NSEC_PER_USEC),
+				st->count ? div64_s64(div64_s64(st->sum_ns,
+					st->count), NSEC_PER_USEC) : 0);
+	}
+
+	return 0;
+}
+
+static int mmc3416x_ttfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc3416x_ttfs_show, inode->i_private);
+}
+
+static const struct file_operations mmc3416x_ttfs_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mmc3416x_ttfs_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int mmc3416x_deadband_show(struct seq_file *s, void *unused)
+{
+	struct mmc3416x_data *memsic = s->private;
+	struct mmc3416x_deadband_stats *st = &memsic->dband;
+
+	seq_printf(s, "reported: %llu\n", st->reported);
+	seq_printf(s, "suppressed: %llu\n", st->suppressed);
+	seq_printf(s, "heartbeats: %llu\n", st->heartbeats);
+
+	return 0;
+}
+
+static int mmc3416x_deadband_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc3416x_deadband_show, inode->i_private);
+}
+
+static const struct file_operations mmc3416x_deadband_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mmc3416x_deadband_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int mmc3416x_phase_show(struct seq_file *s, void *unused)
+{
+	static const char * const names[] = {
+		[MMC3416X_PHASE_TM] = "tm",
+		[MMC3416X_PHASE_STATUS] = "status",
+		[MMC3416X_PHASE_READ] = "read",
+		[MMC3416X_PHASE_SET] = "set",
+		[MMC3416X_PHASE_REPORT] = "report",
+	};
+	struct mmc3416x_data *memsic = s->private;
+	struct mmc3416x_phase_stats *st;
+	int i, j;
+
+	for (i = 0; i < MMC3416X_PHASE_COUNT; i++) {
+		st = &memsic->phase[i];
+		seq_printf(s, "%s: count %llu min_us %llu max_us %llu avg_us %llu\n",
+				names[i], st->count,
+				div64_u64(st->min_ns, NSEC_PER_USEC),
+				div64_u64(st->max_ns, NSEC_PER_USEC),
+				st->count ? div64_u64(div64_u64(st->sum_ns,
+					st->count), NSEC_PER_USEC) : 0);
+		seq_puts(s, "  hist_log2_us:");
+		for (j = 0; j < MMC3416X_HIST_BUCKETS; j++)
+			seq_printf(s, " %llu", st->hist[j]);
+		seq_puts(s, "\n");
+	}
+
+	seq_puts(s, "status_retries:");
+	for (j = 0; j <= MMC3416X_RETRY_COUNT; j++)
+		seq_printf(s, " %llu", memsic->status_retries[j]);
+	seq_puts(s, "\n");
+
+	return 0;
+}
+
+static int mmc3416x_phase_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc3416x_phase_show, inode->i_private);
+}
+
+static const struct file_operations mmc3416x_phase_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mmc3416x_phase_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Any write clears the phase statistics */
+static ssize_t mmc3416x_phase_reset_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct mmc3416x_data *memsic = file->private_data;
+
+	/* a concurrent REPORT update may survive, this is debug data */
+	mutex_lock(&memsic->ecompass_lock);
+	memset(memsic->phase, 0, sizeof(memsic->phase));
+	memset(memsic->status_retries, 0, sizeof(memsic->status_retries));
+	mutex_unlock(&memsic->ecompass_lock);
+
+	return count;
+}
+
+static const struct file_operations mmc3416x_phase_reset_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.write		= mmc3416x_phase_reset_write,
+	.llseek		= noop_llseek,
+};
+
+static void mmc3416x_debugfs_init(struct mmc3416x_data *memsic)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%s-%s", MMC3416X_I2C_NAME,
+			dev_name(&memsic->i2c->dev));
+	memsic->debugfs = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(memsic->debugfs)) {
+		/* debugfs is optional, keep probing without it */
+		memsic->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("sched_stats", S_IRUGO, memsic->debugfs,
+			memsic, &mmc3416x_sched_fops);
+	debugfs_create_file("bus_stats", S_IRUGO, memsic->debugfs,
+			memsic, &mmc3416x_bus_fops);
+	debugfs_create_file("ttfs_stats", S_IRUGO, memsic->debugfs,
+			memsic, &mmc3416x_ttfs_fops);
+	debugfs_create_file("deadband_stats", S_IRUGO, memsic->debugfs,
+			memsic, &mmc3416x_deadband_fops);
+	debugfs_create_file("phase_stats", S_IRUGO, memsic->debugfs,
+			memsic, &mmc3416x_phase_fops);
+	debugfs_create_file("phase_reset", S_IWUSR, memsic->debugfs,
+			memsic, &mmc3416x_phase_reset_fops);
+}
+
+static void mmc3416x_data_release(struct kref *kref)
+{
+	struct mmc3416x_data *memsic = container_of(kref,
+			struct mmc3416x_data, kref);
+
+	vfree(memsic->ring);
+	kfree(memsic);
+}
+
+/*
+ * Stop new opens and fail the file operations of the ones left with
+ * -ENODEV, waking up their readers. After this returns no file operation
+ * touches the chip any more.
+ */
+static void mmc3416x_misc_kill(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_client *client;
+
+	misc_deregister(&memsic->miscdev);
+
+	WRITE_ONCE(memsic->gone, true);
+	wake_up_interruptible(&memsic->ring_wait);
+	spin_lock(&memsic->client_lock);
+	list_for_each_entry(client, &memsic->clients, node)
+		wake_up_interruptible(&client->wait);
+	spin_unlock(&memsic->client_lock);
+
+	/* wait for the ioctls in flight, a waiting one was woken above */
+	down_write(&memsic->unbind_sem);
+	up_write(&memsic->unbind_sem);
+}
+
+static int mmc3416x_misc_open(struct inode *inode, struct file *file)
+{
+	/* misc core points private_data at our miscdevice */
+	struct mmc3416x_data *memsic = container_of(file->private_data,
+			struct mmc3416x_data, miscdev);
+	struct mmc3416x_client *client;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	client->memsic = memsic;
+	init_waitqueue_head(&client->wait);
+	client->ring_tail = READ_ONCE(memsic->ring_head);
+	/* misc_deregister() waits for us, the data is still there */
+	kref_get(&memsic->kref);
+
+	spin_lock(&memsic->client_lock);
+	list_add_tail(&client->node, &memsic->clients);
+	spin_unlock(&memsic->client_lock);
+
+	file->private_data = client;
+
+	return nonseekable_open(inode, file);
+}
+
+static int mmc3416x_misc_release(struct inode *inode, struct file *file)
+{
+	struct mmc3416x_client *client = file->private_data;
+	struct mmc3416x_data *memsic = client->memsic;
+
+	down_read(&memsic->unbind_sem);
+	mutex_lock(&memsic->ops_lock);
+	spin_lock(&memsic->client_lock);
+	list_del(&client->node);
+	spin_unlock(&memsic->client_lock);
+	if (client->interval_ms && !memsic->gone)
+		mmc3416x_update_hw(memsic);
+	mutex_unlock(&memsic->ops_lock);
+	up_read(&memsic->unbind_sem);
+
+	kfree(client);
+	kref_put(&memsic->kref, mmc3416x_data_release);
+
+	return 0;
+}
+
+/* Must be called with ops_lock held */
+static int mmc3416x_client_set_rate(struct mmc3416x_client *client,
+		unsigned int interval_ms)
+{
+	struct mmc3416x_data *memsic = client->memsic;
+	unsigned int min_ms = memsic->cdev.min_delay / USEC_PER_MSEC;
+
+	if (interval_ms && interval_ms < min_ms)
+		interval_ms = min_ms;
+
+	spin_lock(&memsic->client_lock);
+	client->interval_ms = interval_ms;
+	client->next_ns = 0;
+	client->head = client->tail = 0;
+	spin_unlock(&memsic->client_lock);
+
+	return mmc3416x_update_hw(memsic);
+}
+
+static ssize_t mmc3416x_misc_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct mmc3416x_client *client = file->private_data;
+	struct mmc3416x_data *memsic = client->memsic;
+	struct mmc3416x_ring_sample rs;
+	size_t done = 0;
+	int rc;
+
+	if (!client->interval_ms)
+		return -EINVAL;
+
+	if (count < sizeof(rs))
+		return -EINVAL;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (READ_ONCE(client->head) == READ_ONCE(client->tail))
+			return READ_ONCE(memsic->gone) ? -ENODEV : -EAGAIN;
+	} else {
+		rc = wait_event_interruptible(client->wait,
+				READ_ONCE(client->head) !=
+				READ_ONCE(client->tail) ||
+				READ_ONCE(memsic->gone));
+		if (rc)
+			return rc;
+	}
+
+	while (done + sizeof(rs) <= count) {
+		spin_lock(&memsic->client_lock);
+		if (client->head == client->tail) {
+			spin_unlock(&memsic->client_lock);
+			break;
+		}
+		rs = client->fifo[client->tail & MMC3416X_CLIENT_FIFO_MASK];
+		WRITE_ONCE(client->tail, client->tail + 1);
+		spin_unlock(&memsic->client_lock);
+
+		if (copy_to_user(buf + done, &rs, sizeof(rs)))
+			return done ? done : -EFAULT;
+		done += sizeof(rs);
+	}
+
+	if (!done && READ_ONCE(memsic->gone))
+		return -ENODEV;
+
+	return done;
+}
+
+static void mmc3416x_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct mmc3416x_data *memsic = vma->vm_private_data;
+
+	kref_get(&memsic->kref);
+}
+
+static void mmc3416x_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct mmc3416x_data *memsic = vma->vm_private_data;
+
+	kref_put(&memsic->kref, mmc3416x_data_release);
+}
+
+static const struct vm_operations_struct mmc3416x_ring_vm_ops = {
+	.open	= mmc3416x_ring_vm_open,
+	.close	= mmc3416x_ring_vm_close,
+};
+
+static int mmc3416x_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct mmc3416x_client *client = file->private_data;
+	struct mmc3416x_data *memsic = client->memsic;
+	int rc;
+
+	if (vma->vm_pgoff ||
+		vma->vm_end - vma->vm_start > MMC3416X_RING_SIZE)
+		return -EINVAL;
+
+	/* the ring is written by the driver only */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	rc = remap_vmalloc_range(vma, memsic->ring, 0);
+	if (rc)
+		return rc;
+
+	/* the mapping keeps the ring alive after the file is closed */
+	vma->vm_private_data = memsic;
+	vma->vm_ops = &mmc3416x_ring_vm_ops;
+	mmc3416x_ring_vm_open(vma);
+
+	return 0;
+}
+
+/*
+ * Rate clients are readable while their own queue is not empty, everybody
+ * else while the ring head is ahead of the tail the file acknowledged.
+ */
+static unsigned int mmc3416x_ring_poll(struct file *file, poll_table *wait)
+{
+	struct mmc3416x_client *client = file->private_data;
+	struct mmc3416x_data *memsic = client->memsic;
+
+	if (READ_ONCE(memsic->gone))
+		return POLLHUP | POLLERR;
+
+	if (client->interval_ms) {
+		poll_wait(file, &client->wait, wait);
+		if (READ_ONCE(client->head) != READ_ONCE(client->tail))
+			return POLLIN | POLLRDNORM;
+		return 0;
+	}
+
+	poll_wait(file, &memsic->ring_wait, wait);
+
+	if (READ_ONCE(memsic->ring_head) != READ_ONCE(client->ring_tail))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+/*
+ * SET or RESET the sensor for ioctl users. The command runs through the
+ * background state machine right away and the caller waits for it, so
+ * the refill time is not spent holding ecompass_lock.
+ */
+static int mmc3416x_set_reset(struct mmc3416x_data *memsic, u8 cmd)
+{
+	long rc;
+
+	mutex_lock(&memsic->ecompass_lock);
+	/* hw_stop() clears hw_active before it cancels the SET work */
+	if (!memsic->hw_active) {
+		mutex_unlock(&memsic->ecompass_lock);
+		return -ENODEV;
+	}
+	if (memsic->set_state != MMC3416X_SET_IDLE || memsic->set_requested) {
+		mutex_unlock(&memsic->ecompass_lock);
+		return -EBUSY;
+	}
+	memsic->set_cmd = cmd;
+	memsic->set_requested = true;
+	init_completion(&memsic->set_done);
+	mod_delayed_work(system_freezable_wq, &memsic->set_dwork, 0);
+	mutex_unlock(&memsic->ecompass_lock);
+
+	rc = wait_for_completion_interruptible_timeout(&memsic->set_done,
+			msecs_to_jiffies(2 * MMC3416X_DELAY_SET_MS));
+	if (rc < 0)
+		return rc;
+	if (!rc)
+		return -ETIMEDOUT;
+
+	return memsic->set_rc;
+}
+
+/*
+ * Wait until the poll work published count samples newer than the call,
+ * for ioctl users. Nothing is held meanwhile, the poll keeps its pace.
+ */
+static int mmc3416x_wait_samples(struct mmc3416x_data *memsic, u32 count)
+{
+	u32 head = READ_ONCE(memsic->ring_head);
+	unsigned int period_ms = memsic->poll_interval *
+			memsic->filter.oversample;
+	long rc;
+
+	/* twice the period, and room for the SETs pausing the stream */
+	rc = wait_event_interruptible_timeout(memsic->ring_wait,
+			READ_ONCE(memsic->ring_head) - head >= count ||
+			READ_ONCE(memsic->gone),
+			msecs_to_jiffies(2 * count * period_ms +
+				2 * MMC3416X_DELAY_SET_MS));
+	if (rc < 0)
+		return rc;
+	if (READ_ONCE(memsic->gone))
+		return -ENODEV;
+	if (!rc)
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+/* Copy up to count of the newest ring samples into buf */
+static u32 mmc3416x_ring_copy(struct mmc3416x_data *memsic,
+		struct mmc3416x_ring_sample *buf, u32 count)
+{
+	u32 head = READ_ONCE(memsic->ring_head);
+	u32 start, i, lost;
+
+	count = min3(count, head, (u32)MMC3416X_RING_SAMPLES);
+	start = head - count;
+
+	smp_rmb();
+	for (i = 0; i < count; i++)
+		buf[i] = memsic->ring_data[(start + i) & MMC3416X_RING_MASK];
+	smp_rmb();
+
+	/* drop records the producer overwrote while we were copying */
+	lost = READ_ONCE(memsic->ring_head) - head;
+	if (lost >= count)
+		return 0;
+	if (lost) {
+		memmove(buf, buf + lost, (count - lost) * sizeof(*buf));
+		count -= lost;
+	}
+
+	return count;
+}
+
+static int mmc3416x_ioctl_batch(struct mmc3416x_data *memsic,
+		void __user *argp)
+{
+	struct mmc3416x_batch batch;
+	struct mmc3416x_ring_sample *buf;
+	struct mmc3416x_vec vec;
+	struct mmc3416x_vec report;
+	ktime_t timestamp;
+	u32 i;
+	int rc = 0;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.count > MMC3416X_BATCH_MAX)
+		return -EINVAL;
+
+	buf = kcalloc(max_t(u32, batch.count, 1), sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	if (!(batch.flags & MMC3416X_BATCH_FRESH)) {
+		batch.count = mmc3416x_ring_copy(memsic, buf, batch.count);
+		goto copy;
+	}
+
+	/* served from the ring while the poll work runs */
+	if (memsic->polling) {
+		rc = mmc3416x_wait_samples(memsic, batch.count);
+		batch.count = rc ? 0 :
+			mmc3416x_ring_copy(memsic, buf, batch.count);
+		goto copy;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (signal_pending(current)) {
+			rc = -EINTR;
+			break;
+		}
+
+		rc = mmc3416x_measure(memsic, &vec, &timestamp);
+		if (rc)
+			break;
+
+		mmc3416x_transform(memsic, &vec, &report);
+		buf[i].timestamp = ktime_to_ns(timestamp);
+		buf[i].x = report.x;
+		buf[i].y = report.y;
+		buf[i].z = report.z;
+		buf[i].flags = 0;
+	}
+	batch.count = i;
+
+copy:
+	if (batch.count && copy_to_user(
+			(void __user *)(uintptr_t)batch.samples, buf,
+			batch.count * sizeof(*buf)))
+		rc = -EFAULT;
+	else if (copy_to_user(argp, &batch, sizeof(batch)))
+		rc = -EFAULT;
+	else if (batch.count)
+		/* a fresh batch cut short by an error is still returned */
+		rc = 0;
+
+	kfree(buf);
+	return rc;
+}
+
+static long mmc3416x_do_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct mmc3416x_client *client = file->private_data;
+	struct mmc3416x_data *memsic = client->memsic;
+	void __user *argp = (void __user *)arg;
+	unsigned char data[6];
+	unsigned int reg;
+	struct mmc3416x_vec vec;
+	struct mmc3416x_sample sample;
+	struct mmc3416x_ring_sample last;
+	int vals[3];
+	short id;
+	__u32 val;
+	int rc;
+
+	if (cmd == MMC3416X_IOC_READ_BATCH)
+		return mmc3416x_ioctl_batch(memsic, argp);
+
+	if (cmd == MMC3416X_IOC_SET_PRECISION) {
+		if (copy_from_user(&val, argp, sizeof(val)))
+			return -EFAULT;
+		mutex_lock(&memsic->ops_lock);
+		rc = mmc3416x_set_bits(memsic, val);
+		mutex_unlock(&memsic->ops_lock);
+		return rc;
+	}
+
+	if (cmd == MMC3416X_IOC_GET_PRECISION) {
+		val = memsic->bits;
+		if (copy_to_user(argp, &val, sizeof(val)))
+			return -EFAULT;
+		return 0;
+	}
+
+	if (cmd == MMC3416X_IOC_RING_ACK) {
+		if (copy_from_user(&val, argp, sizeof(val)))
+			return -EFAULT;
+		/* never ahead of the producer */
+		if (val - READ_ONCE(client->ring_tail) >
+				READ_ONCE(memsic->ring_head) -
+				READ_ONCE(client->ring_tail))
+			return -EINVAL;
+		WRITE_ONCE(client->ring_tail, val);
+		return 0;
+	}
+
+	if (cmd == MMC3416X_IOC_SET_RATE) {
+		if (copy_from_user(&val, argp, sizeof(val)))
+			return -EFAULT;
+		mutex_lock(&memsic->ops_lock);
+		rc = mmc3416x_client_set_rate(client, val);
+		mutex_unlock(&memsic->ops_lock);
+		return rc;
+	}
+
+	if (cmd == MMC3416X_IOC_SET || cmd == MMC3416X_IOC_RESET)
+		return mmc3416x_set_reset(memsic, cmd == MMC3416X_IOC_SET ?
+				MMC3416X_CTRL_SET : MMC3416X_CTRL_RESET);
+
+	/* the next published sample, measured only when nothing polls */
+	if (cmd == MMC3416X_IOC_READXYZ) {
+		if (memsic->polling) {
+			rc = mmc3416x_wait_samples(memsic, 1);
+			if (rc)
+				return rc;
+			mmc3416x_read_last(memsic, &sample);
+		} else {
+			rc = mmc3416x_measure(memsic, &vec, &sample.timestamp);
+			if (rc)
+				return rc;
+			mmc3416x_transform(memsic, &vec, &sample.vec);
+		}
+		vals[0] = sample.vec.x;
+		vals[1] = sample.vec.y;
+		vals[2] = sample.vec.z;
+		if (copy_to_user(argp, vals, sizeof(vals)))
+			return -EFAULT;
+		return 0;
+	}
+
+	/* no lock and no bus access, timestamp is 0 until the first sample */
+	if (cmd == MMC3416X_IOC_LAST) {
+		mmc3416x_read_last(memsic, &sample);
+		memset(&last, 0, sizeof(last));
+		last.timestamp = ktime_to_ns(sample.timestamp);
+		last.x = sample.vec.x;
+		last.y = sample.vec.y;
+		last.z = sample.vec.z;
+		if (copy_to_user(argp, &last, sizeof(last)))
+			return -EFAULT;
+		return 0;
+	}
+
+	mutex_lock(&memsic->ecompass_lock);
+
+	/* configuration, cached while the chip is powered down */
+	if (cmd == MMC3416X_IOC_NOBOOST) {
+		memsic->ctrl_cfg |= MMC3416X_CTRL_NOBOOST;
+		rc = regmap_update_bits(memsic->regmap, MMC3416X_REG_CTRL,
+				MMC3416X_CTRL_NOBOOST, MMC3416X_CTRL_NOBOOST);
+		goto exit;
+	}
+
+	/* as for SET and READXYZ, only while the sensor is started */
+	if (!memsic->hw_active) {
+		rc = -ENODEV;
+		goto exit;
+	}
+
+	switch (cmd) {
+	case MMC3416X_IOC_TM:
+		/* a TM write would stop continuous mode */
+		if (memsic->ctrl & MMC3416X_CTRL_CM)
+			rc = -EBUSY;
+		else
+			rc = mmc3416x_trigger(memsic);
+		break;
+	case MMC3416X_IOC_READ:
+		/* raw output registers, no conversion */
+		rc = regmap_bulk_read(memsic->regmap, MMC3416X_REG_DATA,
+				data, sizeof(data));
+		if (rc)
+			break;
+		vals[0] = data[1] << 8 | data[0];
+		vals[1] = data[3] << 8 | data[2];
+		vals[2] = data[5] << 8 | data[4];
+		if (copy_to_user(argp, vals, sizeof(vals)))
+			rc = -EFAULT;
+		break;
+	case MMC3416X_IOC_ID:
+		/* served from the register cache */
+		rc = regmap_read(memsic->regmap, MMC3416X_REG_PRODUCTID_1, &reg);
+		if (rc)
+			break;
+		id = reg;
+		if (copy_to_user(argp, &id, sizeof(id)))
+			rc = -EFAULT;
+		break;
+	case MMC3416X_IOC_DIAG:
+		/* status register, bit0 is the measurement done flag */
+		rc = regmap_read(memsic->regmap, MMC3416X_REG_DS, &reg);
+		if (rc)
+			break;
+		vals[0] = reg;
+		if (copy_to_user(argp, vals, sizeof(vals[0])))
+			rc = -EFAULT;
+		break;
+	default:
+		rc = -ENOTTY;
+		break;
+	}
+
+exit:
+	mutex_unlock(&memsic->ecompass_lock);
+	return rc;
+}
+
+static long mmc3416x_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct mmc3416x_client *client = file->private_data;
+	struct mmc3416x_data *memsic = client->memsic;
+	long rc;
+
+	down_read(&memsic->unbind_sem);
+	if (memsic->gone)
+		rc = -ENODEV;
+	else
+		rc = mmc3416x_do_ioctl(file, cmd, arg);
+	up_read(&memsic->unbind_sem);
+
+	return rc;
+}
+
+static const struct file_operations mmc3416x_misc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mmc3416x_misc_open,
+	.release	= mmc3416x_misc_release,
+	.read		= mmc3416x_misc_read,
+	.unlocked_ioctl	= mmc3416x_ioctl,
+	.compat_ioctl	= mmc3416x_ioctl,
+	.mmap		= mmc3416x_ring_mmap,
+	.poll		= mmc3416x_ring_poll,
+	.llseek		= no_llseek,
+};
+
+static int mmc3416x_init_ring(struct mmc3416x_data *memsic)
+{
+	memsic->ring = vmalloc_user(MMC3416X_RING_SIZE);
+	if (!memsic->ring)
+		return -ENOMEM;
+
+	memsic->ring_data = (void *)memsic->ring + PAGE_SIZE;
+	memsic->ring->nr_samples = MMC3416X_RING_SAMPLES;
+	memsic->ring->sample_size = sizeof(struct mmc3416x_ring_sample);
+	memsic->ring->data_offset = PAGE_SIZE;
+	init_waitqueue_head(&memsic->ring_wait);
+
+	memsic->miscdev.minor = MISC_DYNAMIC_MINOR;
+	memsic->miscdev.name = memsic->name;
+	memsic->miscdev.fops = &mmc3416x_misc_fops;
+	memsic->miscdev.parent = &memsic->i2c->dev;
+
+	return 0;
+}
+
+static struct input_dev *mmc3416x_init_input(struct mmc3416x_data *memsic)
+{
+	struct i2c_client *client = memsic->i2c;
+	int status;
+	struct input_dev *input = NULL;
+
+	input = devm_input_allocate_device(&client->dev);
+	if (!input)
+		return NULL;
+
+	input->name = memsic->input_name;
+	input->phys = memsic->input_phys;
+	input->id.bustype = BUS_I2C;
+
+	__set_bit(EV_ABS, input->evbit);
+
+	input_set_abs_params(input, ABS_X, -2047, 2047, 0, 0);
+	input_set_abs_params(input, ABS_Y, -2047, 2047, 0, 0);
+	input_set_abs_params(input, ABS_Z, -2047, 2047, 0, 0);
+
+	/* the fused partner is reported on the rotation axes */
+	if (memsic->partner) {
+		input_set_abs_params(input, ABS_RX, -2047, 2047, 0, 0);
+		input_set_abs_params(input, ABS_RY, -2047, 2047, 0, 0);
+		input_set_abs_params(input, ABS_RZ, -2047, 2047, 0, 0);
+	}
+
+	input_set_capability(input, EV_REL, REL_X);
+	input_set_capability(input, EV_REL, REL_Y);
+	input_set_capability(input, EV_REL, REL_Z);
+
+	/*
+	 * The hint is per packet and evdev keeps EVDEV_BUF_PACKETS of them
+	 * per client, spread a full FIFO flush over those.
+	 */
+	input_set_events_per_packet(input,
+			DIV_ROUND_UP(MMC3416X_FIFO_SIZE *
+				MMC3416X_EVENTS_PER_SAMPLE,
+				MMC3416X_EVDEV_BUF_PACKETS));
+
+	status = input_register_device(input);
+	if (status) {
+		dev_err(&client->dev,
+			"error registering input device\n");
+		return NULL;
+	}
+
+	return input;
+}
+
+static ssize_t mmc3416x_value_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	struct mmc3416x_sample sample;
+
+	mmc3416x_read_last(memsic, &sample);
+
+	return snprintf(buf, PAGE_SIZE, "%d %d %d %lld\n",
+			sample.vec.x, sample.vec.y, sample.vec.z,
+			ktime_to_ns(sample.timestamp));
+}
+
+static DEVICE_ATTR(value, S_IRUGO, mmc3416x_value_show, NULL);
+
+static ssize_t mmc3416x_precision_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	ssize_t count = 0;
+	int i;
+
+	/* list every mode, the active one in brackets */
+	for (i = 0; i < ARRAY_SIZE(mmc3416x_modes); i++)
+		count += scnprintf(buf + count, PAGE_SIZE - count,
+				i == memsic->bits ? "[%s] " : "%s ",
+				mmc3416x_modes[i].name);
+	buf[count - 1] = '\n';
+
+	return count;
+}
+
+static ssize_t mmc3416x_precision_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	int i;
+	int rc;
+
+	for (i = 0; i < ARRAY_SIZE(mmc3416x_modes); i++) {
+		if (sysfs_streq(buf, mmc3416x_modes[i].name))
+			break;
+	}
+
+	mutex_lock(&memsic->ops_lock);
+	rc = mmc3416x_set_bits(memsic, i);
+	mutex_unlock(&memsic->ops_lock);
+
+	return rc ? rc : count;
+}
+
+static DEVICE_ATTR(precision, S_IRUGO | S_IWUSR, mmc3416x_precision_show,
+		mmc3416x_precision_store);
+
+/*
+ * "ox oy oz s00 s01 s02 s10 s11 s12 s20 s21 s22": hard iron offsets in raw
+ * counts and the soft iron matrix in Q16, "0" restores the identity.
+ */
+static ssize_t mmc3416x_calibration_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	struct mmc3416x_calib calib;
+
+	mutex_lock(&memsic->ops_lock);
+	calib = memsic->calib;
+	mutex_unlock(&memsic->ops_lock);
+
+	return snprintf(buf, PAGE_SIZE, "%d %d %d %d %d %d %d %d %d %d %d %d\n",
+			calib.offset[0], calib.offset[1], calib.offset[2],
+			calib.soft[0], calib.soft[1], calib.soft[2],
+			calib.soft[3], calib.soft[4], calib.soft[5],
+			calib.soft[6], calib.soft[7], calib.soft[8]);
+}
+
+static ssize_t mmc3416x_calibration_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	struct mmc3416x_calib calib;
+	int i;
+
+	if (sysfs_streq(buf, "0")) {
+		mmc3416x_calib_reset(&calib);
+	} else {
+		if (sscanf(buf, "%d %d %d %d %d %d %d %d %d %d %d %d",
+				&calib.offset[0], &calib.offset[1],
+				&calib.offset[2],
+				&calib.soft[0], &calib.soft[1], &calib.soft[2],
+				&calib.soft[3], &calib.soft[4], &calib.soft[5],
+				&calib.soft[6], &calib.soft[7],
+				&calib.soft[8]) != 12)
+			return -EINVAL;
+
+		/* keep every product of the transform inside s64 */
+		for (i = 0; i < 3; i++) {
+			if (abs(calib.offset[i]) > MMC3416X_CAL_OFFSET_MAX)
+				return -EINVAL;
+		}
+		for (i = 0; i < 9; i++) {
+			if (abs(calib.soft[i]) > MMC3416X_CAL_SOFT_MAX)
+				return -EINVAL;
+		}
+	}
+
+	mutex_lock(&memsic->ops_lock);
+	memsic->calib = calib;
+	mmc3416x_update_xform(memsic);
+	mutex_unlock(&memsic->ops_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR(calibration, S_IRUGO | S_IWUSR, mmc3416x_calibration_show,
+		mmc3416x_calibration_store);
+
+/*
+ * Apply a new filter configuration, a changed oversample ratio also
+ * changes the hardware rate. Must be called with ops_lock held.
+ */
+static int mmc3416x_filter_config(struct mmc3416x_data *memsic,
+		unsigned int oversample, unsigned int order, unsigned int iir_shift)
+{
+	spin_lock(&memsic->filter_lock);
+	memsic->filter.oversample = oversample;
+	memsic->filter.order = order;
+	memsic->filter.iir_shift = iir_shift;
+	mmc3416x_filter_reset(&memsic->filter);
+	spin_unlock(&memsic->filter_lock);
+
+	return mmc3416x_update_hw(memsic);
+}
+
+static ssize_t mmc3416x_oversample_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", memsic->filter.oversample);
+}
+
+static ssize_t mmc3416x_oversample_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	unsigned int interval;
+	unsigned int val;
+	int rc;
+
+	rc = kstrtouint(buf, 0, &val);
+	if (rc)
+		return rc;
+
+	if (!val || val > MMC3416X_OVERSAMPLE_MAX || !is_power_of_2(val))
+		return -EINVAL;
+
+	mutex_lock(&memsic->ops_lock);
+	/* the chip cannot run fast enough for the requested output rate */
+	interval = mmc3416x_stream_interval(memsic);
+	if (interval && interval / val <
+			memsic->cdev.min_delay / USEC_PER_MSEC) {
+		mutex_unlock(&memsic->ops_lock);
+		return -ERANGE;
+	}
+	rc = mmc3416x_filter_config(memsic, val, memsic->filter.order,
+			memsic->filter.iir_shift);
+	mutex_unlock(&memsic->ops_lock);
+
+	return rc ? rc : count;
+}
+
+static DEVICE_ATTR(oversample, S_IRUGO | S_IWUSR, mmc3416x_oversample_show,
+		mmc3416x_oversample_store);
+
+static ssize_t mmc3416x_filter_mode_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	ssize_t count = 0;
+	int i;
+
+	for (i = MMC3416X_FILTER_BOXCAR; i < ARRAY_SIZE(mmc3416x_filter_modes);
+			i++)
+		count += scnprintf(buf + count, PAGE_SIZE - count,
+				i == memsic->filter.order ? "[%s] " : "%s ",
+				mmc3416x_filter_modes[i]);
+	buf[count - 1] = '\n';
+
+	return count;
+}
+
+static ssize_t mmc3416x_filter_mode_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	int i;
+	int rc;
+
+	for (i = MMC3416X_FILTER_BOXCAR; i < ARRAY_SIZE(mmc3416x_filter_modes);
+			i++) {
+		if (sysfs_streq(buf, mmc3416x_filter_modes[i]))
+			break;
+	}
+	if (i >= ARRAY_SIZE(mmc3416x_filter_modes))
+		return -EINVAL;
+
+	mutex_lock(&memsic->ops_lock);
+	rc = mmc3416x_filter_config(memsic, memsic->filter.oversample, i,
+			memsic->filter.iir_shift);
+	mutex_unlock(&memsic->ops_lock);
+
+	return rc ? rc : count;
+}
+
+static DEVICE_ATTR(filter_mode, S_IRUGO | S_IWUSR, mmc3416x_filter_mode_show,
+		mmc3416x_filter_mode_store);
+
+static ssize_t mmc3416x_iir_shift_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", memsic->filter.iir_shift);
+}
+
+static ssize_t mmc3416x_iir_shift_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	unsigned int val;
+	int rc;
+
+	rc = kstrtouint(buf, 0, &val);
+	if (rc)
+		return rc;
+
+	/* 0 disables the IIR, otherwise alpha = 1 / 2^val */
+	if (val > MMC3416X_IIR_SHIFT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&memsic->ops_lock);
+	rc = mmc3416x_filter_config(memsic, memsic->filter.oversample,
+			memsic->filter.order, val);
+	mutex_unlock(&memsic->ops_lock);
+
+	return rc ? rc : count;
+}
+
+static DEVICE_ATTR(iir_shift, S_IRUGO | S_IWUSR, mmc3416x_iir_shift_show,
+		mmc3416x_iir_shift_store);
+
+static ssize_t mmc3416x_deadband_show_attr(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", memsic->deadband);
+}
+
+static ssize_t mmc3416x_deadband_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	unsigned int val;
+	int rc;
+
+	rc = kstrtouint(buf, 0, &val);
+	if (rc)
+		return rc;
+
+	memsic->deadband = val;
+
+	return count;
+}
+
+static DEVICE_ATTR(deadband, S_IRUGO | S_IWUSR, mmc3416x_deadband_show_attr,
+		mmc3416x_deadband_store);
+
+static ssize_t mmc3416x_heartbeat_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
 
-	vec.x = vec.y = vec.z = 0;
+	return snprintf(buf, PAGE_SIZE, "%u\n", memsic->heartbeat_ms);
+}
 
-	ret = mmc3416x_read_xyz(memsic, &vec);
-	if (ret) {
-		dev_warn(&memsic->i2c->dev, "read xyz failed\n");
-		goto exit;
-	}
+static ssize_t mmc3416x_heartbeat_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	unsigned int val;
+	int rc;
 
-	tmp = &mmc3416x_rotation_matrix[memsic->dir][0];
-	report.x = tmp[0] * vec.x + tmp[1] * vec.y + tmp[2] * vec.z;
-	report.y = tmp[3] * vec.x + tmp[4] * vec.y + tmp[5] * vec.z;
-	report.z = tmp[6] * vec.x + tmp[7] * vec.y + tmp[8] * vec.z;
+	/* 0 never repeats a sample that stays within the deadband */
+	rc = kstrtouint(buf, 0, &val);
+	if (rc)
+		return rc;
 
-	timestamp = ktime_get_boottime();
-	input_report_abs(memsic->idev, ABS_X, report.x);
-	input_report_abs(memsic->idev, ABS_Y, report.y);
-	input_report_abs(memsic->idev, ABS_Z, report.z);
-	input_event(memsic->idev,
-			EV_SYN, SYN_TIME_SEC,
-			ktime_to_timespec(timestamp).tv_sec);
-	input_event(memsic->idev,
-		EV_SYN, SYN_TIME_NSEC,
-		ktime_to_timespec(timestamp).tv_nsec);
-	input_sync(memsic->idev);
+	memsic->heartbeat_ms = val;
 
-exit:
-	queue_delayed_work(memsic->data_wq,
-			&memsic->dwork,
-			msecs_to_jiffies(memsic->poll_interval));
+	return count;
 }
 
-static struct input_dev *mmc3416x_init_input(struct i2c_client *client)
+static DEVICE_ATTR(heartbeat_ms, S_IRUGO | S_IWUSR,
+		mmc3416x_heartbeat_ms_show, mmc3416x_heartbeat_ms_store);
+
+static ssize_t mmc3416x_suspend_batch_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	int status;
-	struct input_dev *input = NULL;
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
 
-	input = devm_input_allocate_device(&client->dev);
-	if (!input)
-		return NULL;
+	return snprintf(buf, PAGE_SIZE, "%d\n", memsic->suspend_batch);
+}
 
-	input->name = "compass";
-	input->phys = "mmc3416x/input0";
-	input->id.bustype = BUS_I2C;
+/*
+ * Keep the chip measuring over short suspends instead of powering it off,
+ * at the cost of its continuous mode current while suspended.
+ */
+static ssize_t mmc3416x_suspend_batch_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	unsigned int val;
+	int rc;
 
-	__set_bit(EV_ABS, input->evbit);
+	rc = kstrtouint(buf, 0, &val);
+	if (rc)
+		return rc;
 
-	input_set_abs_params(input, ABS_X, -2047, 2047, 0, 0);
-	input_set_abs_params(input, ABS_Y, -2047, 2047, 0, 0);
-	input_set_abs_params(input, ABS_Z, -2047, 2047, 0, 0);
+	mutex_lock(&memsic->ops_lock);
+	memsic->suspend_batch = !!val;
+	mutex_unlock(&memsic->ops_lock);
 
-	input_set_capability(input, EV_REL, REL_X);
-	input_set_capability(input, EV_REL, REL_Y);
-	input_set_capability(input, EV_REL, REL_Z);
+	return count;
+}
 
-	status = input_register_device(input);
-	if (status) {
-		dev_err(&client->dev,
-			"error registering input device\n");
-		return NULL;
-	}
+static DEVICE_ATTR(suspend_batch, S_IRUGO | S_IWUSR,
+		mmc3416x_suspend_batch_show, mmc3416x_suspend_batch_store);
+
+static struct attribute *mmc3416x_attrs[] = {
+	&dev_attr_value.attr,
+	&dev_attr_precision.attr,
+	&dev_attr_calibration.attr,
+	&dev_attr_oversample.attr,
+	&dev_attr_filter_mode.attr,
+	&dev_attr_iir_shift.attr,
+	&dev_attr_deadband.attr,
+	&dev_attr_heartbeat_ms.attr,
+	&dev_attr_suspend_batch.attr,
+	NULL,
+};
 
-	return input;
-}
+static const struct attribute_group mmc3416x_attr_group = {
+	.attrs = mmc3416x_attrs,
+};
 
 static int mmc3416x_power_init(struct mmc3416x_data *data)
 {
@@ -346,12 +2914,6 @@ static int mmc3416x_power_init(struct mmc3416x_data *data)
 		}
 	}
 
-	rc = regulator_enable(data->vdd);
-	if (rc) {
-		dev_err(&data->i2c->dev,
-				"Regulator enable vdd failed rc=%d\n", rc);
-		goto exit;
-	}
 	data->vio = devm_regulator_get(&data->i2c->dev, "vio");
 	if (IS_ERR(data->vio)) {
 		rc = PTR_ERR(data->vio);
@@ -369,22 +2931,12 @@ static int mmc3416x_power_init(struct mmc3416x_data *data)
 			goto reg_vdd_set;
 		}
 	}
-	rc = regulator_enable(data->vio);
-	if (rc) {
-		dev_err(&data->i2c->dev,
-				"Regulator enable vio failed rc=%d\n", rc);
-		goto reg_vdd_set;
-	}
-
-	 /* The minimum time to operate device after VDD valid is 10 ms. */
-	usleep_range(15000, 20000);
-
-	data->power_enabled = true;
+	/* the supplies are only enabled by the first runtime resume */
+	data->power_enabled = false;
 
 	return 0;
 
 reg_vdd_set:
-	regulator_disable(data->vdd);
 	if (regulator_count_voltages(data->vdd) > 0)
 		regulator_set_voltage(data->vdd, 0, MMC3416X_VDD_MAX_UV);
 exit:
@@ -399,7 +2951,8 @@ static int mmc3416x_power_deinit(struct mmc3416x_data *data)
 			regulator_set_voltage(data->vio, 0,
 					MMC3416X_VIO_MAX_UV);
 
-		regulator_disable(data->vio);
+		if (data->power_enabled)
+			regulator_disable(data->vio);
 	}
 
 	if (!IS_ERR_OR_NULL(data->vdd)) {
@@ -407,7 +2960,8 @@ static int mmc3416x_power_deinit(struct mmc3416x_data *data)
 			regulator_set_voltage(data->vdd, 0,
 					MMC3416X_VDD_MAX_UV);
 
-		regulator_disable(data->vdd);
+		if (data->power_enabled)
+			regulator_disable(data->vdd);
 	}
 
 	data->power_enabled = false;
@@ -437,6 +2991,10 @@ static int mmc3416x_power_set(struct mmc3416x_data *memsic, bool on)
 		}
 		memsic->power_enabled = false;
 
+		/* registers are lost, restore them from the cache at power on */
+		regcache_cache_only(memsic->regmap, true);
+		regcache_mark_dirty(memsic->regmap);
+
 		mutex_unlock(&memsic->ecompass_lock);
 		return rc;
 	} else if (on && !memsic->power_enabled) {
@@ -462,6 +3020,14 @@ static int mmc3416x_power_set(struct mmc3416x_data *memsic, bool on)
 		/* The minimum time to operate after VDD valid is 10 ms */
 		usleep_range(15000, 20000);
 
+		mutex_lock(&memsic->ecompass_lock);
+		regcache_cache_only(memsic->regmap, false);
+		rc = regcache_sync(memsic->regmap);
+		mutex_unlock(&memsic->ecompass_lock);
+		if (rc)
+			dev_err(&memsic->i2c->dev,
+				"Register restore failed rc=%d\n", rc);
+
 		return rc;
 	} else {
 		dev_warn(&memsic->i2c->dev,
@@ -535,6 +3101,10 @@ static int mmc3416x_parse_dt(struct i2c_client *client,
 	else
 		memsic->auto_report = 0;
 
+	/* optional, keeps the default when absent */
+	of_property_read_u32(np, "memsic,autosuspend-delay-ms",
+			&memsic->autosuspend_delay);
+
 	return 0;
 }
 
@@ -548,40 +3118,42 @@ static int mmc3416x_set_enable(struct sensors_classdev *sensors_cdev,
 	mutex_lock(&memsic->ops_lock);
 
 	if (enable && (!memsic->enable)) {
-		rc = mmc3416x_power_set(memsic, true);
-		if (rc) {
-			dev_err(&memsic->i2c->dev, "Power up failed\n");
-			goto exit;
-		}
-
-		/* send TM cmd before read */
-		rc = regmap_write(memsic->regmap, MMC3416X_REG_CTRL,
-				MMC3416X_CTRL_TM);
+		memsic->enable_time = ktime_get_boottime();
+		/*
+		 * Cold when this enable has to power the chip up. A client
+		 * may already keep it running, or the autosuspend delay may
+		 * still keep it powered.
+		 */
+		memsic->ttfs_pending =
+			(!memsic->hw_active &&
+				pm_runtime_suspended(&memsic->i2c->dev)) ?
+			MMC3416X_TTFS_COLD + 1 : MMC3416X_TTFS_WARM + 1;
+
+		mutex_lock(&memsic->fifo_lock);
+		memsic->enable = enable;
+		memsic->hal_next_ns = 0;
+		/* the first sample after enable always goes out */
+		memsic->hal_last_valid = false;
+		mutex_unlock(&memsic->fifo_lock);
+
+		rc = mmc3416x_update_hw(memsic);
 		if (rc) {
-			dev_err(&memsic->i2c->dev, "write reg %d failed.(%d)\n",
-					MMC3416X_REG_CTRL, rc);
-			goto exit;
+			memsic->enable = 0;
+			memsic->ttfs_pending = 0;
 		}
-
-		memsic->timeout = jiffies;
-		if (memsic->auto_report)
-			queue_delayed_work(memsic->data_wq,
-				&memsic->dwork,
-				msecs_to_jiffies(memsic->poll_interval));
 	} else if ((!enable) && memsic->enable) {
-		if (memsic->auto_report)
-			cancel_delayed_work_sync(&memsic->dwork);
+		mutex_lock(&memsic->fifo_lock);
+		memsic->enable = enable;
+		mmc3416x_fifo_drain(memsic);
+		mutex_unlock(&memsic->fifo_lock);
 
-		if (mmc3416x_power_set(memsic, false))
-			dev_warn(&memsic->i2c->dev, "Power off failed\n");
+		mmc3416x_update_hw(memsic);
 	} else {
 		dev_warn(&memsic->i2c->dev,
 				"ignore enable state change from %d to %d\n",
 				memsic->enable, enable);
 	}
-	memsic->enable = enable;
 
-exit:
 	mutex_unlock(&memsic->ops_lock);
 	return rc;
 }
@@ -591,28 +3163,303 @@ static int mmc3416x_set_poll_delay(struct sensors_classdev *sensors_cdev,
 {
 	struct mmc3416x_data *memsic = container_of(sensors_cdev,
 			struct mmc3416x_data, cdev);
+	int rc = 0;
 
 	mutex_lock(&memsic->ops_lock);
-	if (memsic->poll_interval != delay_msec)
-		memsic->poll_interval = delay_msec;
+	memsic->hal_interval = delay_msec;
+	memsic->hal_next_ns = 0;
 
-	if (memsic->auto_report && memsic->enable)
-		mod_delayed_work(system_wq, &memsic->dwork,
-				msecs_to_jiffies(delay_msec));
+	if (memsic->enable)
+		rc = mmc3416x_update_hw(memsic);
 	mutex_unlock(&memsic->ops_lock);
 
+	return rc;
+}
+
+static int mmc3416x_set_latency(struct sensors_classdev *sensors_cdev,
+		unsigned int max_latency)
+{
+	struct mmc3416x_data *memsic = container_of(sensors_cdev,
+			struct mmc3416x_data, cdev);
+
+	mutex_lock(&memsic->fifo_lock);
+	/* deliver what was batched under the old latency */
+	mmc3416x_fifo_drain(memsic);
+	memsic->max_latency = max_latency;
+	mutex_unlock(&memsic->fifo_lock);
+
+	return 0;
+}
+
+static int mmc3416x_flush(struct sensors_classdev *sensors_cdev)
+{
+	struct mmc3416x_data *memsic = container_of(sensors_cdev,
+			struct mmc3416x_data, cdev);
+
+	mutex_lock(&memsic->fifo_lock);
+	mmc3416x_fifo_drain(memsic);
+	/* tell the HAL the flush is complete */
+	input_event(memsic->idev, EV_SYN, SYN_CONFIG, memsic->flush_count++);
+	input_sync(memsic->idev);
+	mutex_unlock(&memsic->fifo_lock);
+
 	return 0;
 }
 
+static int mmc3416x_bus_write(void *context, const void *data, size_t count)
+{
+	struct mmc3416x_data *memsic = context;
+	int ret;
+
+	memsic->bus.writes++;
+	ret = i2c_master_send(memsic->i2c, data, count);
+	if (ret == count)
+		return 0;
+
+	return ret < 0 ? ret : -EIO;
+}
+
+static int mmc3416x_bus_read(void *context, const void *reg, size_t reg_size,
+		void *val, size_t val_size)
+{
+	struct mmc3416x_data *memsic = context;
+	struct i2c_msg xfer[2];
+	int ret;
+
+	xfer[0].addr = memsic->i2c->addr;
+	xfer[0].flags = 0;
+	xfer[0].len = reg_size;
+	xfer[0].buf = (void *)reg;
+
+	xfer[1].addr = memsic->i2c->addr;
+	xfer[1].flags = I2C_M_RD;
+	xfer[1].len = val_size;
+	xfer[1].buf = val;
+
+	memsic->bus.reads++;
+	ret = i2c_transfer(memsic->i2c->adapter, xfer, 2);
+	if (ret == 2)
+		return 0;
+
+	return ret < 0 ? ret : -EIO;
+}
+
+/* plain i2c access, but counted so bus traffic shows up in debugfs */
+static const struct regmap_bus mmc3416x_regmap_bus = {
+	.write = mmc3416x_bus_write,
+	.read = mmc3416x_bus_read,
+};
+
+static const struct regmap_range mmc3416x_readable_ranges[] = {
+	regmap_reg_range(MMC3416X_REG_DATA, MMC3416X_REG_DS),
+	regmap_reg_range(MMC3416X_REG_PRODUCTID_0, MMC3416X_REG_PRODUCTID_0),
+	regmap_reg_range(MMC3416X_REG_PRODUCTID_1, MMC3416X_REG_PRODUCTID_1),
+};
+
+static const struct regmap_range mmc3416x_writeable_ranges[] = {
+	regmap_reg_range(MMC3416X_REG_CTRL, MMC3416X_REG_BITS),
+};
+
+static const struct regmap_range mmc3416x_volatile_ranges[] = {
+	regmap_reg_range(MMC3416X_REG_DATA, MMC3416X_REG_DS),
+};
+
+static const struct regmap_access_table mmc3416x_readable_table = {
+	.yes_ranges = mmc3416x_readable_ranges,
+	.n_yes_ranges = ARRAY_SIZE(mmc3416x_readable_ranges),
+};
+
+static const struct regmap_access_table mmc3416x_writeable_table = {
+	.yes_ranges = mmc3416x_writeable_ranges,
+	.n_yes_ranges = ARRAY_SIZE(mmc3416x_writeable_ranges),
+};
+
+static const struct regmap_access_table mmc3416x_volatile_table = {
+	.yes_ranges = mmc3416x_volatile_ranges,
+	.n_yes_ranges = ARRAY_SIZE(mmc3416x_volatile_ranges),
+};
+
+/* CTRL and BITS are write only, seed the cache with their reset values */
+static const struct reg_default mmc3416x_reg_defaults[] = {
+	{ MMC3416X_REG_CTRL, 0x00 },
+	{ MMC3416X_REG_BITS, MMC3416X_BITS_SLOW_16 },
+};
+
 static struct regmap_config mmc3416x_regmap_config = {
 	.reg_bits = 8,
 	.val_bits = 8,
+	.max_register = MMC3416X_REG_PRODUCTID_1,
+	.rd_table = &mmc3416x_readable_table,
+	.wr_table = &mmc3416x_writeable_table,
+	.volatile_table = &mmc3416x_volatile_table,
+	.reg_defaults = mmc3416x_reg_defaults,
+	.num_reg_defaults = ARRAY_SIZE(mmc3416x_reg_defaults),
+	.cache_type = REGCACHE_RBTREE,
 };
 
+/* Whether some mmc3416x node names target as its memsic,fused-partner */
+static bool mmc3416x_is_partner_node(struct device_node *target)
+{
+	struct device_node *np, *partner;
+
+	for_each_compatible_node(np, NULL, "memsic,mmc3416x") {
+		partner = of_parse_phandle(np, "memsic,fused-partner", 0);
+		of_node_put(partner);
+		if (partner == target) {
+			of_node_put(np);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * The HAL takes the instance with the legacy names and handle as its
+ * default magnetometer. Choose it from DT alone so neither the probe
+ * order nor a deferred probe moves it: the node with memsic,legacy-names,
+ * else the first available node that is no fused partner.
+ */
+static bool mmc3416x_legacy_node(struct device_node *node)
+{
+	struct device_node *np;
+	bool found;
+
+	for_each_compatible_node(np, NULL, "memsic,mmc3416x") {
+		if (of_device_is_available(np) &&
+			of_property_read_bool(np, "memsic,legacy-names")) {
+			found = np == node;
+			of_node_put(np);
+			return found;
+		}
+	}
+
+	for_each_compatible_node(np, NULL, "memsic,mmc3416x") {
+		if (of_device_is_available(np) &&
+			!mmc3416x_is_partner_node(np)) {
+			found = np == node;
+			of_node_put(np);
+			return found;
+		}
+	}
+
+	return false;
+}
+
+static void mmc3416x_init_names(struct mmc3416x_data *memsic)
+{
+	struct i2c_client *client = memsic->i2c;
+	int nr = i2c_adapter_id(client->adapter);
+
+	if (memsic->legacy) {
+		strlcpy(memsic->name, MMC3416X_I2C_NAME, sizeof(memsic->name));
+		strlcpy(memsic->cdev_name, sensors_cdev.name,
+				sizeof(memsic->cdev_name));
+		strlcpy(memsic->input_name, "compass",
+				sizeof(memsic->input_name));
+		strlcpy(memsic->input_phys, "mmc3416x/input0",
+				sizeof(memsic->input_phys));
+		return;
+	}
+
+	snprintf(memsic->name, sizeof(memsic->name), "%s-%d-%04x",
+			MMC3416X_I2C_NAME, nr, client->addr);
+	snprintf(memsic->cdev_name, sizeof(memsic->cdev_name), "%s-%d-%04x",
+			sensors_cdev.name, nr, client->addr);
+	snprintf(memsic->input_name, sizeof(memsic->input_name),
+			"compass-%d-%04x", nr, client->addr);
+	snprintf(memsic->input_phys, sizeof(memsic->input_phys),
+			"mmc3416x/input-%d-%04x", nr, client->addr);
+}
+
+/*
+ * memsic,fused-partner points at a second mmc3416x that this instance
+ * reads in its own poll cycle and reports on ABS_RX/RY/RZ.
+ */
+static int mmc3416x_fused_init(struct mmc3416x_data *memsic)
+{
+	struct device *dev = &memsic->i2c->dev;
+	struct device_node *np;
+	struct i2c_client *pclient;
+	struct mmc3416x_data *partner;
+
+	if (!dev->of_node)
+		return 0;
+
+	np = of_parse_phandle(dev->of_node, "memsic,fused-partner", 0);
+	if (!np)
+		return 0;
+
+	pclient = of_find_i2c_device_by_node(np);
+	of_node_put(np);
+	if (!pclient)
+		return -EPROBE_DEFER;
+
+	partner = i2c_get_clientdata(pclient);
+	if (!partner || !partner->probed) {
+		put_device(&pclient->dev);
+		return -EPROBE_DEFER;
+	}
+
+	if (partner == memsic || partner->partner || partner->fused_primary) {
+		dev_err(dev, "Invalid memsic,fused-partner property");
+		put_device(&pclient->dev);
+		return -EINVAL;
+	}
+
+	mutex_lock(&partner->ops_lock);
+	partner->fused_primary = memsic;
+	mutex_unlock(&partner->ops_lock);
+	memsic->partner = partner;
+
+	dev_info(dev, "fused with %s\n", dev_name(&pclient->dev));
+
+	return 0;
+}
+
+/* Primary side, the poll must no longer run */
+static void mmc3416x_fused_release(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_data *partner = memsic->partner;
+
+	if (!partner)
+		return;
+
+	mutex_lock(&partner->ops_lock);
+	partner->fused_primary = NULL;
+	partner->fused_interval = 0;
+	mmc3416x_update_hw(partner);
+	mutex_unlock(&partner->ops_lock);
+
+	memsic->partner = NULL;
+	put_device(&partner->i2c->dev);
+}
+
+/* Partner side, leave the primary running on its own */
+static void mmc3416x_fused_detach(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_data *primary = memsic->fused_primary;
+
+	if (!primary)
+		return;
+
+	mutex_lock(&primary->ops_lock);
+	if (primary->polling)
+		mmc3416x_sched_stop(primary);
+	primary->partner = NULL;
+	if (primary->polling)
+		mmc3416x_sched_start(primary);
+	mutex_unlock(&primary->ops_lock);
+
+	memsic->fused_primary = NULL;
+	put_device(&memsic->i2c->dev);
+}
+
 static int mmc3416x_probe(struct i2c_client *client, const struct i2c_device_id *id)
 {
 	int res = 0;
 	struct mmc3416x_data *memsic;
+	ktime_t start = ktime_get();
 
 	dev_dbg(&client->dev, "probing mmc3416x\n");
 
@@ -622,20 +3469,24 @@ static int mmc3416x_probe(struct i2c_client *client, const struct i2c_device_id
 		goto out;
 	}
 
-	memsic = devm_kzalloc(&client->dev, sizeof(struct mmc3416x_data),
-			GFP_KERNEL);
+	/* refcounted, open files of the misc device may outlive the unbind */
+	memsic = kzalloc(sizeof(struct mmc3416x_data), GFP_KERNEL);
 	if (!memsic) {
 		dev_err(&client->dev, "memory allocation failed.\n");
 		res = -ENOMEM;
 		goto out;
 	}
+	kref_init(&memsic->kref);
+	init_rwsem(&memsic->unbind_sem);
+
+	memsic->autosuspend_delay = MMC3416X_AUTOSUSPEND_DELAY_MS;
 
 	if (client->dev.of_node) {
 		res = mmc3416x_parse_dt(client, memsic);
 		if (res) {
 			dev_err(&client->dev,
 				"Unable to parse platform data.(%d)", res);
-			goto out;
+			goto out_free;
 		}
 	} else {
 		memsic->dir = 0;
@@ -647,77 +3498,143 @@ static int mmc3416x_probe(struct i2c_client *client, const struct i2c_device_id
 
 	mutex_init(&memsic->ecompass_lock);
 	mutex_init(&memsic->ops_lock);
-
-	memsic->regmap = devm_regmap_init_i2c(client, &mmc3416x_regmap_config);
+	mutex_init(&memsic->fifo_lock);
+	seqcount_init(&memsic->last_seq);
+	seqcount_init(&memsic->xform_seq);
+	mmc3416x_calib_reset(&memsic->calib);
+	mmc3416x_update_xform(memsic);
+	INIT_LIST_HEAD(&memsic->clients);
+	spin_lock_init(&memsic->filter_lock);
+	memsic->filter.oversample = 1;
+	memsic->filter.order = MMC3416X_FILTER_BOXCAR;
+	mmc3416x_filter_reset(&memsic->filter);
+	spin_lock_init(&memsic->client_lock);
+	INIT_DELAYED_WORK(&memsic->set_dwork, mmc3416x_set_work);
+	memsic->set_cmd = MMC3416X_CTRL_SET;
+	init_completion(&memsic->set_done);
+
+	memsic->regmap = devm_regmap_init(&client->dev, &mmc3416x_regmap_bus,
+			memsic, &mmc3416x_regmap_config);
 	if (IS_ERR(memsic->regmap)) {
 		dev_err(&client->dev, "Init regmap failed.(%ld)",
 				PTR_ERR(memsic->regmap));
 		res = PTR_ERR(memsic->regmap);
-		goto out;
+		goto out_free;
 	}
+	/* unpowered until the first runtime resume syncs the cache */
+	regcache_cache_only(memsic->regmap, true);
 
-	res = mmc3416x_power_init(memsic);
-	if (res) {
-		dev_err(&client->dev, "Power up mmc3416x failed\n");
-		goto out;
+	res = ida_simple_get(&mmc3416x_ida, 0, 0, GFP_KERNEL);
+	if (res < 0) {
+		dev_err(&client->dev, "Get instance id failed.(%d)", res);
+		goto out_free;
 	}
+	memsic->id = res;
+	/* without DT there is no order to go by, the first id takes them */
+	memsic->legacy = client->dev.of_node ?
+		mmc3416x_legacy_node(client->dev.of_node) : !memsic->id;
+	mmc3416x_init_names(memsic);
 
-	res = mmc3416x_check_device(memsic);
+	res = mmc3416x_power_init(memsic);
 	if (res) {
-		dev_err(&client->dev, "Check device failed\n");
-		goto out_check_device;
+		dev_err(&client->dev, "Init mmc3416x power failed\n");
+		goto out_power_init;
 	}
 
-	memsic->idev = mmc3416x_init_input(client);
+	res = mmc3416x_fused_init(memsic);
+	if (res)
+		goto out_fused_init;
+
+	memsic->idev = mmc3416x_init_input(memsic);
 	if (!memsic->idev) {
 		dev_err(&client->dev, "init input device failed\n");
 		res = -ENODEV;
 		goto out_init_input;
 	}
 
-	memsic->data_wq = NULL;
 	if (memsic->auto_report) {
 		dev_dbg(&client->dev, "auto report is enabled\n");
-		INIT_DELAYED_WORK(&memsic->dwork, mmc3416x_poll);
-		memsic->data_wq =
-			create_freezable_workqueue("mmc3416_data_work");
-		if (!memsic->data_wq) {
-			dev_err(&client->dev, "Cannot create workqueue.\n");
-			goto out_create_workqueue;
+		res = sensor_poll_register(&memsic->poller, client->adapter,
+				mmc3416x_poll);
+		if (res) {
+			dev_err(&client->dev, "Cannot register poller.\n");
+			goto out_register_poller;
 		}
 	}
 
+	memsic->poll_interval = MMC3416X_DEFAULT_INTERVAL_MS;
+	memsic->hal_interval = MMC3416X_DEFAULT_INTERVAL_MS;
+	memsic->heartbeat_ms = MMC3416X_HEARTBEAT_MS;
+
+	/* stays suspended, and unpowered, until the first enable */
+	pm_runtime_set_autosuspend_delay(&client->dev,
+			memsic->autosuspend_delay);
+	pm_runtime_use_autosuspend(&client->dev);
+	pm_runtime_enable(&client->dev);
+
+	res = mmc3416x_init_ring(memsic);
+	if (res) {
+		dev_err(&client->dev, "init sample ring failed\n");
+		goto out_init_ring;
+	}
+
+	/* the interfaces userspace can enable the sensor through go last */
 	memsic->cdev = sensors_cdev;
+	memsic->cdev.name = memsic->cdev_name;
+	if (!memsic->legacy)
+		memsic->cdev.handle = MMC3416X_HANDLE(
+				i2c_adapter_id(client->adapter), client->addr);
 	memsic->cdev.sensors_enable = mmc3416x_set_enable;
 	memsic->cdev.sensors_poll_delay = mmc3416x_set_poll_delay;
+	memsic->cdev.sensors_set_latency = mmc3416x_set_latency;
+	memsic->cdev.sensors_flush = mmc3416x_flush;
 	res = sensors_classdev_register(&memsic->idev->dev, &memsic->cdev);
 	if (res) {
 		dev_err(&client->dev, "sensors class register failed.\n");
 		goto out_register_classdev;
 	}
 
-	res = mmc3416x_power_set(memsic, false);
+	res = misc_register(&memsic->miscdev);
 	if (res) {
-		dev_err(&client->dev, "Power off failed\n");
-		goto out_power_set;
+		dev_err(&client->dev, "misc device register failed.\n");
+		goto out_register_misc;
 	}
 
-	memsic->poll_interval = MMC3416X_DEFAULT_INTERVAL_MS;
+	res = sysfs_create_group(&client->dev.kobj, &mmc3416x_attr_group);
+	if (res) {
+		dev_err(&client->dev, "sysfs create group failed.\n");
+		goto out_create_sysfs;
+	}
+
+	mmc3416x_debugfs_init(memsic);
+	memsic->probed = true;
 
-	dev_info(&client->dev, "mmc3416x successfully probed\n");
+	dev_info(&client->dev, "mmc3416x successfully probed as %s in %lld us\n",
+			memsic->cdev_name,
+			ktime_us_delta(ktime_get(), start));
 
 	return 0;
 
-out_power_set:
+out_create_sysfs:
+	mmc3416x_misc_kill(memsic);
+out_register_misc:
 	sensors_classdev_unregister(&memsic->cdev);
 out_register_classdev:
-	if (memsic->data_wq)
-		destroy_workqueue(memsic->data_wq);
-out_create_workqueue:
+out_init_ring:
+	pm_runtime_disable(&client->dev);
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	if (memsic->auto_report)
+		sensor_poll_unregister(&memsic->poller);
+out_register_poller:
 	input_unregister_device(memsic->idev);
 out_init_input:
-out_check_device:
+	mmc3416x_fused_release(memsic);
+out_fused_init:
 	mmc3416x_power_deinit(memsic);
+out_power_init:
+	ida_simple_remove(&mmc3416x_ida, memsic->id);
+out_free:
+	kref_put(&memsic->kref, mmc3416x_data_release);
 out:
 	return res;
 }
@@ -726,17 +3643,115 @@ static int mmc3416x_remove(struct i2c_client *client)
 {
 	struct mmc3416x_data *memsic = dev_get_drvdata(&client->dev);
 
+	memsic->probed = false;
+	mmc3416x_fused_detach(memsic);
+
+	debugfs_remove_recursive(memsic->debugfs);
+	sysfs_remove_group(&client->dev.kobj, &mmc3416x_attr_group);
+	mmc3416x_misc_kill(memsic);
 	sensors_classdev_unregister(&memsic->cdev);
-	if (memsic->data_wq)
-		destroy_workqueue(memsic->data_wq);
+
+	/* drop the runtime PM reference a running stream still holds */
+	mutex_lock(&memsic->ops_lock);
+	if (memsic->hw_active)
+		mmc3416x_hw_stop(memsic);
+	mutex_unlock(&memsic->ops_lock);
+	mmc3416x_set_stop(memsic);
+	if (memsic->auto_report)
+		sensor_poll_unregister(&memsic->poller);
+	mmc3416x_fused_release(memsic);
+
+	pm_runtime_disable(&client->dev);
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
 	mmc3416x_power_deinit(memsic);
 
 	if (memsic->idev)
 		input_unregister_device(memsic->idev);
 
+	ida_simple_remove(&mmc3416x_ida, memsic->id);
+	/* freed here unless a file or a ring mapping is still around */
+	kref_put(&memsic->kref, mmc3416x_data_release);
+
 	return 0;
 }
 
+/*
+ * Leave the chip powered in its slowest continuous mode over suspend, so
+ * there is a fresh sample to report right at resume.
+ * Must be called with ops_lock held.
+ */
+static int mmc3416x_suspend_batch(struct mmc3416x_data *memsic)
+{
+	int rc;
+
+	mutex_lock(&memsic->ecompass_lock);
+	memsic->suspend_ctrl = memsic->ctrl;
+	memsic->ctrl = MMC3416X_CTRL_CM | mmc3416x_cm_rates[0].ctrl;
+	/* a cancelled SET may have left CTRL cleared, always write it */
+	rc = mmc3416x_restart_measure(memsic);
+	if (rc) {
+		dev_err(&memsic->i2c->dev, "write reg %d failed.(%d)\n",
+				MMC3416X_REG_CTRL, rc);
+		memsic->ctrl = memsic->suspend_ctrl;
+	}
+	mutex_unlock(&memsic->ecompass_lock);
+
+	memsic->suspend_batched = !rc;
+
+	return rc;
+}
+
+/*
+ * Report the sample the chip measured last and hand the batch collected
+ * before suspend to the HAL, then restore the measurement mode.
+ */
+static void mmc3416x_resume_drain(struct mmc3416x_data *memsic)
+{
+	struct mmc3416x_sample report;
+	struct mmc3416x_vec vec;
+	int rc;
+
+	mutex_lock(&memsic->ecompass_lock);
+	/* the data registers hold the last continuous measurement */
+	rc = mmc3416x_fetch_xyz(memsic, &vec);
+	memsic->ctrl = memsic->suspend_ctrl;
+	if (mmc3416x_start_measure(memsic))
+		dev_warn(&memsic->i2c->dev, "write reg %d failed at %d\n",
+				MMC3416X_REG_CTRL, __LINE__);
+	mutex_unlock(&memsic->ecompass_lock);
+
+	spin_lock(&memsic->filter_lock);
+	mmc3416x_filter_reset(&memsic->filter);
+	spin_unlock(&memsic->filter_lock);
+
+	if (rc) {
+		/* flag the gap on the next polled sample instead */
+		memsic->gap_pending = true;
+	} else {
+		mmc3416x_transform(memsic, &vec, &report.vec);
+		report.partner_valid = false;
+		report.gap = true;
+		/* on average half a period old when read */
+		report.timestamp = ktime_sub_ns(ktime_get_boottime(),
+				(u64)mmc3416x_cm_rates[0].interval_ms *
+				NSEC_PER_MSEC / 2);
+
+		mmc3416x_publish_last(memsic, &report);
+		mmc3416x_ring_push(memsic, &report, MMC3416X_SAMPLE_GAP);
+		mmc3416x_clients_push(memsic, &report);
+
+		mmc3416x_decimate(memsic, &memsic->hal_next_ns,
+				memsic->hal_interval, report.timestamp);
+		if (!mmc3416x_suppress(memsic, &report))
+			mmc3416x_fifo_push(memsic, &report);
+	}
+
+	mutex_lock(&memsic->fifo_lock);
+	mmc3416x_fifo_drain(memsic);
+	mutex_unlock(&memsic->fifo_lock);
+}
+
 static int mmc3416x_suspend(struct device *dev)
 {
 	int res = 0;
@@ -745,16 +3760,21 @@ static int mmc3416x_suspend(struct device *dev)
 	dev_dbg(dev, "suspended\n");
 	mutex_lock(&memsic->ops_lock);
 
-	if (memsic->enable) {
-		if (memsic->auto_report)
-			cancel_delayed_work_sync(&memsic->dwork);
+	if (memsic->hw_active) {
+		if (memsic->polling)
+			mmc3416x_sched_stop(memsic);
+		mmc3416x_set_stop(memsic);
 
-		res = mmc3416x_power_set(memsic, false);
-		if (res) {
-			dev_err(dev, "failed to suspend mmc3416x\n");
+		if (memsic->polling && memsic->suspend_batch &&
+				!mmc3416x_suspend_batch(memsic))
 			goto exit;
-		}
 	}
+
+	/* also cuts power held by a pending autosuspend */
+	res = pm_runtime_force_suspend(dev);
+	if (res)
+		dev_err(dev, "failed to suspend mmc3416x\n");
+
 exit:
 	mutex_unlock(&memsic->ops_lock);
 	return res;
@@ -767,23 +3787,75 @@ static int mmc3416x_resume(struct device *dev)
 
 	dev_dbg(dev, "resumed\n");
 
-	if (memsic->enable) {
-		res = mmc3416x_power_set(memsic, true);
-		if (res) {
-			dev_err(&memsic->i2c->dev, "Power enable failed\n");
-			goto exit;
-		}
+	if (memsic->suspend_batched) {
+		/* still powered, keep the SET cadence */
+		mmc3416x_resume_drain(memsic);
+		memsic->suspend_batched = false;
+		queue_delayed_work(system_freezable_wq, &memsic->set_dwork,
+				msecs_to_jiffies(MMC3416X_TIMEOUT_SET_MS));
+		mmc3416x_sched_start(memsic);
+		return 0;
+	}
+
+	res = pm_runtime_force_resume(dev);
+	if (res) {
+		dev_err(&memsic->i2c->dev, "Power enable failed\n");
+		goto exit;
+	}
+
+	if (memsic->hw_active) {
+		/* Power was cut, SET the chip before sampling again */
+		queue_delayed_work(system_freezable_wq, &memsic->set_dwork, 0);
+		memsic->cold_start = false;
+		memsic->gap_pending = true;
 
-		if (memsic->auto_report)
-			queue_delayed_work(memsic->data_wq,
-				&memsic->dwork,
-				msecs_to_jiffies(memsic->poll_interval));
+		if (memsic->polling)
+			mmc3416x_sched_start(memsic);
+	} else {
+		pm_runtime_mark_last_busy(dev);
+		pm_request_autosuspend(dev);
 	}
 
 exit:
 	return res;
 }
 
+static int mmc3416x_runtime_suspend(struct device *dev)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+
+	dev_dbg(dev, "runtime suspended\n");
+
+	return mmc3416x_power_set(memsic, false);
+}
+
+static int mmc3416x_runtime_resume(struct device *dev)
+{
+	struct mmc3416x_data *memsic = dev_get_drvdata(dev);
+	int res;
+
+	dev_dbg(dev, "runtime resumed\n");
+
+	res = mmc3416x_power_set(memsic, true);
+	if (res)
+		return res;
+
+	/* probe leaves the chip unpowered, check it on the first power up */
+	if (!memsic->verified) {
+		res = mmc3416x_check_device(memsic);
+		if (res) {
+			dev_err(dev, "Check device failed.(%d)\n", res);
+			mmc3416x_power_set(memsic, false);
+			return res;
+		}
+		memsic->verified = true;
+	}
+
+	memsic->cold_start = true;
+
+	return 0;
+}
+
 static const struct i2c_device_id mmc3416x_id[] = {
 	{ MMC3416X_I2C_NAME, 0 },
 	{ }
@@ -797,6 +3869,8 @@ static struct of_device_id mmc3416x_match_table[] = {
 static const struct dev_pm_ops mmc3416x_pm_ops = {
 	.suspend = mmc3416x_suspend,
 	.resume = mmc3416x_resume,
+	SET_RUNTIME_PM_OPS(mmc3416x_runtime_suspend,
+			mmc3416x_runtime_resume, NULL)
 };
 
 static struct i2c_driver mmc3416x_driver = {
@@ -808,6 +3882,10 @@ static struct i2c_driver mmc3416x_driver = {
 		.name	= MMC3416X_I2C_NAME,
 		.of_match_table = mmc3416x_match_table,
 		.pm = &mmc3416x_pm_ops,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		/* nothing in probe touches the bus, let it run in parallel */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 	},
 };
 
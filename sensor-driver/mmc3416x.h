@@ -24,6 +24,7 @@
 #define __MMC3416X_H__
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define MMC3416X_I2C_NAME		"mmc3416x"
 
@@ -46,9 +47,52 @@
 #define MMC3416X_CTRL_RESET              0x40
 #define MMC3416X_CTRL_REFILL             0x80
 
+#define MMC3416X_DS_MEAS_DONE		0x01
+
 #define MMC3416X_BITS_SLOW_16            0x00
 #define MMC3416X_BITS_FAST_16            0x01
 #define MMC3416X_BITS_14                 0x02
+/*
+ * Sample ring shared read-only through mmap() of the misc device. The
+ * first page holds the header, records start at data_offset. The driver
+ * advances head after a record is complete. Every open file has its own
+ * read cursor, the consumer sets it to the index it has read up to with
+ * MMC3416X_IOC_RING_ACK, poll() reports POLLIN while head is ahead of it.
+ */
+struct mmc3416x_ring_header {
+	__u32	head;
+	__u32	reserved;
+	__u32	nr_samples;
+	__u32	sample_size;
+	__u32	data_offset;
+};
+
+struct mmc3416x_ring_sample {
+	__s64	timestamp;	/* boottime in ns */
+	__s32	x;
+	__s32	y;
+	__s32	z;
+	__u32	flags;
+};
+
+/* samples were lost before this one, e.g. across a system suspend */
+#define MMC3416X_SAMPLE_GAP	0x01
+
+/*
+ * Batched read: without MMC3416X_BATCH_FRESH the newest count samples of
+ * the ring are returned, with it count new measurements are taken.
+ * samples points to struct mmc3416x_ring_sample[count], count is updated
+ * with the number of samples returned.
+ */
+struct mmc3416x_batch {
+	__u32	count;
+	__u32	flags;
+	__u64	samples;
+};
+
+#define MMC3416X_BATCH_FRESH		0x01
+#define MMC3416X_BATCH_MAX		1024
+
 /* Use 'm' as magic number */
 #define MMC3416X_IOM			'm'
 
@@ -60,6 +104,15 @@
 #define MMC3416X_IOC_RESET               _IO (MMC3416X_IOM, 0x04)
 #define MMC3416X_IOC_NOBOOST             _IO (MMC3416X_IOM, 0x05)
 #define MMC3416X_IOC_ID                  _IOR(MMC3416X_IOM, 0x06, short)
+#define MMC3416X_IOC_READ_BATCH		_IOWR(MMC3416X_IOM, 0x07, struct mmc3416x_batch)
+#define MMC3416X_IOC_LAST		_IOR(MMC3416X_IOM, 0x08, struct mmc3416x_ring_sample)
+/* sample interval in ms for this file's read() stream, 0 to unregister */
+#define MMC3416X_IOC_SET_RATE		_IOW(MMC3416X_IOM, 0x09, __u32)
+/* output resolution mode, one of MMC3416X_BITS_* */
+#define MMC3416X_IOC_SET_PRECISION	_IOW(MMC3416X_IOM, 0x0a, __u32)
+#define MMC3416X_IOC_GET_PRECISION	_IOR(MMC3416X_IOM, 0x0b, __u32)
+/* ring index this file has read up to, see struct mmc3416x_ring_header */
+#define MMC3416X_IOC_RING_ACK		_IOW(MMC3416X_IOM, 0x0c, __u32)
 #define MMC3416X_IOC_DIAG                _IOR(MMC3416X_IOM, 0x14, int[1])
 
 
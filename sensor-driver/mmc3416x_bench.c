@@ -0,0 +1,237 @@
+/*
+ * Userspace benchmark for the mmc3416x driver.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * For every poll interval given on the command line, register that rate
+ * on the misc device, read a number of samples from it and print one line
+ * with the achieved rate and the jitter of the sample timestamps, plus the
+ * I2C transactions and the busy time per sample taken from the driver's
+ * debugfs statistics. Build with:
+ *
+ *	gcc -O2 -Wall -o mmc3416x_bench mmc3416x_bench.c -lm
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "mmc3416x.h"
+
+#define DEFAULT_DEV		"/dev/" MMC3416X_I2C_NAME
+#define DEFAULT_DEBUGFS		"/sys/kernel/debug/" MMC3416X_I2C_NAME "-*"
+#define DEFAULT_SAMPLES		200
+
+struct bus_stats {
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long samples;
+};
+
+struct sched_stats {
+	unsigned long long overruns;
+	unsigned long long busy_avg_us;
+	unsigned long long busy_max_us;
+};
+
+/* Text after "key:" in a debugfs file, NULL if absent */
+static char *stat_line(const char *dir, const char *file, const char *key,
+		char *line, size_t size)
+{
+	char path[512];
+	size_t len = strlen(key);
+	char *found = NULL;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	while (fgets(line, size, f)) {
+		if (!strncmp(line, key, len) && line[len] == ':') {
+			found = line + len + 1;
+			break;
+		}
+	}
+
+	fclose(f);
+	return found;
+}
+
+static unsigned long long stat_value(const char *dir, const char *file,
+		const char *key)
+{
+	char line[256];
+	char *val = stat_line(dir, file, key, line, sizeof(line));
+
+	return val ? strtoull(val, NULL, 0) : 0;
+}
+
+static void read_bus(const char *dir, struct bus_stats *st)
+{
+	st->reads = stat_value(dir, "bus_stats", "reads");
+	st->writes = stat_value(dir, "bus_stats", "writes");
+	st->samples = stat_value(dir, "bus_stats", "samples");
+}
+
+static void read_sched(const char *dir, struct sched_stats *st)
+{
+	char line[256];
+	char *val;
+
+	st->overruns = stat_value(dir, "sched_stats", "overruns");
+	st->busy_max_us = st->busy_avg_us = 0;
+	val = stat_line(dir, "sched_stats", "busy_us", line, sizeof(line));
+	if (val)
+		sscanf(val, " max %llu avg %llu", &st->busy_max_us,
+				&st->busy_avg_us);
+}
+
+static int run(int fd, const char *dir, unsigned int interval, int count)
+{
+	struct mmc3416x_ring_sample *buf;
+	struct bus_stats b0, b1;
+	struct sched_stats sc;
+	double sum = 0, sq = 0, dev_max = 0, mean, span, xfers = 0;
+	__u32 rate = interval;
+	int gaps = 0;
+	int i, n;
+
+	buf = calloc(count, sizeof(*buf));
+	if (!buf)
+		return -ENOMEM;
+
+	read_bus(dir, &b0);
+	if (ioctl(fd, MMC3416X_IOC_SET_RATE, &rate) < 0) {
+		perror("MMC3416X_IOC_SET_RATE");
+		free(buf);
+		return -errno;
+	}
+
+	for (n = 0; n < count; ) {
+		ssize_t r = read(fd, buf + n, (count - n) * sizeof(*buf));
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		n += r / sizeof(*buf);
+	}
+
+	/* sched_stats restart with every rate change, read them first */
+	read_sched(dir, &sc);
+	rate = 0;
+	ioctl(fd, MMC3416X_IOC_SET_RATE, &rate);
+	read_bus(dir, &b1);
+
+	for (i = 1; i < n; i++) {
+		double d = (buf[i].timestamp - buf[i - 1].timestamp) / 1e3;
+		double err = fabs(d - interval * 1e3);
+
+		if (buf[i].flags & MMC3416X_SAMPLE_GAP)
+			gaps++;
+		sum += err;
+		sq += err * err;
+		if (err > dev_max)
+			dev_max = err;
+	}
+
+	span = n > 1 ? (buf[n - 1].timestamp - buf[0].timestamp) / 1e9 : 0;
+	mean = n > 1 ? sum / (n - 1) : 0;
+	if (b1.samples > b0.samples)
+		xfers = (double)(b1.reads + b1.writes - b0.reads - b0.writes) /
+			(b1.samples - b0.samples);
+
+	printf("%8u %8d %10.3f %10.1f %10.1f %10.1f %8.2f %8llu %8llu %8llu %6d\n",
+		interval, n, span > 0 ? (n - 1) / span : 0, mean,
+		n > 1 ? sqrt(sq / (n - 1) - mean * mean) : 0, dev_max,
+		xfers, sc.busy_avg_us, sc.busy_max_us, sc.overruns, gaps);
+
+	free(buf);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-s debugfs dir] [-n samples] interval_ms...\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = DEFAULT_DEV;
+	const char *dir = NULL;
+	int count = DEFAULT_SAMPLES;
+	glob_t g = { 0 };
+	int fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "d:s:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			dir = optarg;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || count < 2)
+		usage(argv[0]);
+
+	/* the first instance unless told otherwise */
+	if (!dir) {
+		if (glob(DEFAULT_DEBUGFS, 0, NULL, &g) || !g.gl_pathc) {
+			fprintf(stderr, "no %s, is debugfs mounted?\n",
+				DEFAULT_DEBUGFS);
+			return 1;
+		}
+		dir = g.gl_pathv[0];
+	}
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+
+	printf("%8s %8s %10s %10s %10s %10s %8s %8s %8s %8s %6s\n",
+		"int_ms", "samples", "rate_hz", "jit_avg", "jit_sd",
+		"jit_max", "xfer/smp", "busy_us", "busy_max", "overrun",
+		"gaps");
+
+	for (i = optind; i < argc; i++) {
+		if (run(fd, dir, strtoul(argv[i], NULL, 0), count))
+			break;
+	}
+
+	close(fd);
+	globfree(&g);
+	return 0;
+}
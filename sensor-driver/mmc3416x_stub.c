@@ -0,0 +1,297 @@
+/*
+ * Emulated MMC3416x on a private I2C adapter.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Loading this module adds an I2C adapter with a register model of the
+ * MMC3416x and instantiates the mmc3416x driver on it, so the driver can
+ * be exercised and benchmarked without the part. The model covers what
+ * the driver relies on:
+ *
+ * - a TM clears MEAS_DONE and starts a conversion that lasts the
+ *   conversion time of the BITS mode, MEAS_DONE is set when it is over
+ * - continuous mode refreshes the data at the CM frequency
+ * - SET and RESET flip the polarity of the output
+ * - TM, SET, RESET and REFILL are self clearing command bits
+ *
+ * The field is a triangle wave per axis, so samples change and a run is
+ * reproducible. Time is taken from the monotonic clock at each transfer.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/i2c.h>
+#include <linux/version.h>
+
+#include "mmc3416x.h"
+
+#define STUB_PRODUCT_ID		0x06
+#define STUB_NR_REGS		(MMC3416X_REG_PRODUCTID_1 + 1)
+#define STUB_CTRL_CMDS		(MMC3416X_CTRL_TM | MMC3416X_CTRL_SET | \
+				MMC3416X_CTRL_RESET | MMC3416X_CTRL_REFILL)
+#define STUB_CTRL_FREQ		0x0c
+
+static unsigned short addr = MMC3416X_I2C_ADDR;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "I2C address of the emulated chip");
+
+/* conversion time of a TM, indexed by MMC3416X_BITS_* */
+static const unsigned int stub_conv_us[] = {
+	[MMC3416X_BITS_SLOW_16]	= 7920,
+	[MMC3416X_BITS_FAST_16]	= 4080,
+	[MMC3416X_BITS_14]	= 2160,
+};
+
+/* continuous mode period, indexed by the CTRL frequency bits */
+static const unsigned int stub_cm_ms[] = { 20, 40, 84, 84 };
+
+struct mmc3416x_stub {
+	struct i2c_adapter	adap;
+	struct i2c_client	*client;
+	/* protects everything below, transfers may come from any context */
+	struct mutex		lock;
+	u8			regs[STUB_NR_REGS];
+	u8			ptr;
+	/* a TM in flight completes at conv_done */
+	bool			converting;
+	ktime_t			conv_done;
+	/* continuous mode periods since cm_start already measured */
+	ktime_t			cm_start;
+	u64			cm_seen;
+	bool			reset;
+	u64			seq;
+};
+
+static struct mmc3416x_stub *stub;
+
+/* triangle wave of the given period in samples, between -amp and amp */
+static int stub_wave(u64 seq, unsigned int period, int amp)
+{
+	unsigned int pos = do_div(seq, period);
+	int half = period / 2;
+
+	if (pos < half)
+		return -amp + 2 * amp * (int)pos / half;
+
+	return amp - 2 * amp * (int)(pos - half) / half;
+}
+
+/* Latch a new measurement into the data registers */
+static void stub_measure(struct mmc3416x_stub *st)
+{
+	u8 bits = st->regs[MMC3416X_REG_BITS];
+	int offset = bits == MMC3416X_BITS_14 ? 8192 : 32768;
+	int field[3];
+	int i;
+
+	field[0] = stub_wave(st->seq, 200, 800);
+	field[1] = stub_wave(st->seq + 50, 200, 800);
+	field[2] = stub_wave(st->seq, 500, 400);
+	st->seq++;
+
+	for (i = 0; i < 3; i++) {
+		int val = offset + (st->reset ? -field[i] : field[i]);
+
+		st->regs[MMC3416X_REG_DATA + 2 * i] = val & 0xff;
+		st->regs[MMC3416X_REG_DATA + 2 * i + 1] = (val >> 8) & 0xff;
+	}
+	st->regs[MMC3416X_REG_DS] |= MMC3416X_DS_MEAS_DONE;
+}
+
+/* Complete the conversions that finished by now */
+static void stub_update(struct mmc3416x_stub *st, ktime_t now)
+{
+	u8 ctrl = st->regs[MMC3416X_REG_CTRL];
+	s64 period;
+	u64 n;
+
+	if (st->converting && ktime_compare(now, st->conv_done) >= 0) {
+		st->converting = false;
+		stub_measure(st);
+	}
+
+	if (!(ctrl & MMC3416X_CTRL_CM))
+		return;
+
+	period = (s64)stub_cm_ms[(ctrl & STUB_CTRL_FREQ) >> 2] *
+			NSEC_PER_MSEC;
+	n = div64_u64(ktime_to_ns(ktime_sub(now, st->cm_start)), period);
+	if (n > st->cm_seen) {
+		st->cm_seen = n;
+		stub_measure(st);
+	}
+}
+
+static void stub_write_ctrl(struct mmc3416x_stub *st, u8 val, ktime_t now)
+{
+	u8 bits = st->regs[MMC3416X_REG_BITS];
+
+	if (val & MMC3416X_CTRL_SET)
+		st->reset = false;
+	if (val & MMC3416X_CTRL_RESET)
+		st->reset = true;
+
+	if ((val & MMC3416X_CTRL_TM) && !st->converting) {
+		st->converting = true;
+		st->conv_done = ktime_add_us(now,
+				stub_conv_us[bits < ARRAY_SIZE(stub_conv_us) ?
+					bits : MMC3416X_BITS_SLOW_16]);
+		st->regs[MMC3416X_REG_DS] &= ~MMC3416X_DS_MEAS_DONE;
+	}
+
+	/* entering continuous mode, or changing its frequency, restarts it */
+	if ((val & MMC3416X_CTRL_CM) &&
+		(val & (MMC3416X_CTRL_CM | STUB_CTRL_FREQ)) !=
+		(st->regs[MMC3416X_REG_CTRL] &
+			(MMC3416X_CTRL_CM | STUB_CTRL_FREQ))) {
+		st->cm_start = now;
+		st->cm_seen = 0;
+		st->regs[MMC3416X_REG_DS] &= ~MMC3416X_DS_MEAS_DONE;
+	}
+
+	st->regs[MMC3416X_REG_CTRL] = val & ~STUB_CTRL_CMDS;
+}
+
+static void stub_write_reg(struct mmc3416x_stub *st, u8 reg, u8 val,
+		ktime_t now)
+{
+	switch (reg) {
+	case MMC3416X_REG_CTRL:
+		stub_write_ctrl(st, val, now);
+		break;
+	case MMC3416X_REG_BITS:
+		st->regs[reg] = val;
+		break;
+	default:
+		/* data, status and product ID are read-only */
+		break;
+	}
+}
+
+static int stub_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+	struct mmc3416x_stub *st = i2c_get_adapdata(adap);
+	ktime_t now = ktime_get();
+	int i, j;
+
+	mutex_lock(&st->lock);
+	stub_update(st, now);
+
+	for (i = 0; i < num; i++) {
+		struct i2c_msg *msg = &msgs[i];
+
+		if (msg->addr != addr) {
+			mutex_unlock(&st->lock);
+			return -ENXIO;
+		}
+
+		if (msg->flags & I2C_M_RD) {
+			/* the register pointer auto increments */
+			for (j = 0; j < msg->len; j++, st->ptr++)
+				msg->buf[j] = st->ptr < STUB_NR_REGS ?
+					st->regs[st->ptr] : 0;
+			continue;
+		}
+
+		if (!msg->len)
+			continue;
+		st->ptr = msg->buf[0];
+		for (j = 1; j < msg->len; j++, st->ptr++)
+			stub_write_reg(st, st->ptr, msg->buf[j], now);
+	}
+
+	mutex_unlock(&st->lock);
+
+	return num;
+}
+
+static u32 stub_func(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm stub_algo = {
+	.master_xfer	= stub_xfer,
+	.functionality	= stub_func,
+};
+
+static int __init mmc3416x_stub_init(void)
+{
+	struct i2c_board_info info = {
+		I2C_BOARD_INFO(MMC3416X_I2C_NAME, 0),
+	};
+	int rc;
+
+	stub = kzalloc(sizeof(*stub), GFP_KERNEL);
+	if (!stub)
+		return -ENOMEM;
+
+	mutex_init(&stub->lock);
+	stub->regs[MMC3416X_REG_PRODUCTID_1] = STUB_PRODUCT_ID;
+	stub->regs[MMC3416X_REG_BITS] = MMC3416X_BITS_SLOW_16;
+
+	stub->adap.owner = THIS_MODULE;
+	stub->adap.algo = &stub_algo;
+	strlcpy(stub->adap.name, "MMC3416x stub", sizeof(stub->adap.name));
+	i2c_set_adapdata(&stub->adap, stub);
+
+	rc = i2c_add_adapter(&stub->adap);
+	if (rc) {
+		pr_err("mmc3416x_stub: add adapter failed.(%d)\n", rc);
+		goto out_free;
+	}
+
+	info.addr = addr;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	stub->client = i2c_new_client_device(&stub->adap, &info);
+	if (IS_ERR(stub->client)) {
+		rc = PTR_ERR(stub->client);
+		goto out_del_adapter;
+	}
+#else
+	stub->client = i2c_new_device(&stub->adap, &info);
+	if (!stub->client) {
+		rc = -ENODEV;
+		goto out_del_adapter;
+	}
+#endif
+
+	pr_info("mmc3416x_stub: emulating mmc3416x at %d-%04x\n",
+			i2c_adapter_id(&stub->adap), addr);
+
+	return 0;
+
+out_del_adapter:
+	pr_err("mmc3416x_stub: new device failed.(%d)\n", rc);
+	i2c_del_adapter(&stub->adap);
+out_free:
+	kfree(stub);
+	return rc;
+}
+
+static void __exit mmc3416x_stub_exit(void)
+{
+	i2c_unregister_device(stub->client);
+	i2c_del_adapter(&stub->adap);
+	kfree(stub);
+}
+
+module_init(mmc3416x_stub_init);
+module_exit(mmc3416x_stub_exit);
+
+MODULE_DESCRIPTION("Emulated MMC3416x for testing the mmc3416x driver");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2010 MEMSIC, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Tracepoints of the mmc3416x sample pipeline, found under
+ * events/mmc3416x/ in tracefs. The driver Makefile needs
+ * CFLAGS_mmc3416x.o := -I$(src) for the include below to resolve.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mmc3416x
+
+#if !defined(_MMC3416X_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MMC3416X_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(mmc3416x_enable,
+
+	TP_PROTO(struct device *dev, int enable, unsigned int interval_ms),
+
+	TP_ARGS(dev, enable, interval_ms),
+
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(int, enable)
+		__field(unsigned int, interval_ms)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->enable = enable;
+		__entry->interval_ms = interval_ms;
+	),
+
+	TP_printk("%s enable=%d interval_ms=%u", __get_str(name),
+		__entry->enable, __entry->interval_ms)
+);
+
+TRACE_EVENT(mmc3416x_tm,
+
+	TP_PROTO(struct device *dev, int rc),
+
+	TP_ARGS(dev, rc),
+
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(int, rc)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->rc = rc;
+	),
+
+	TP_printk("%s rc=%d", __get_str(name), __entry->rc)
+);
+
+TRACE_EVENT(mmc3416x_data_ready,
+
+	TP_PROTO(struct device *dev, unsigned int status, int retries),
+
+	TP_ARGS(dev, status, retries),
+
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(unsigned int, status)
+		__field(int, retries)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->status = status;
+		__entry->retries = retries;
+	),
+
+	TP_printk("%s status=0x%02x retries=%d", __get_str(name),
+		__entry->status, __entry->retries)
+);
+
+TRACE_EVENT(mmc3416x_read,
+
+	TP_PROTO(struct device *dev, int x, int y, int z, int rc),
+
+	TP_ARGS(dev, x, y, z, rc),
+
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(int, x)
+		__field(int, y)
+		__field(int, z)
+		__field(int, rc)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->x = x;
+		__entry->y = y;
+		__entry->z = z;
+		__entry->rc = rc;
+	),
+
+	TP_printk("%s raw=%d,%d,%d rc=%d", __get_str(name),
+		__entry->x, __entry->y, __entry->z, __entry->rc)
+);
+
+TRACE_EVENT(mmc3416x_set,
+
+	TP_PROTO(struct device *dev, int state, int rc),
+
+	TP_ARGS(dev, state, rc),
+
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(int, state)
+		__field(int, rc)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->state = state;
+		__entry->rc = rc;
+	),
+
+	TP_printk("%s state=%s rc=%d", __get_str(name),
+		__print_symbolic(__entry->state,
+			{ 0, "idle" }, { 1, "refill" }, { 2, "set" }),
+		__entry->rc)
+);
+
+TRACE_EVENT(mmc3416x_report,
+
+	TP_PROTO(struct device *dev, int rx, int ry, int rz,
+		int x, int y, int z, s64 timestamp),
+
+	TP_ARGS(dev, rx, ry, rz, x, y, z, timestamp),
+
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(int, rx)
+		__field(int, ry)
+		__field(int, rz)
+		__field(int, x)
+		__field(int, y)
+		__field(int, z)
+		__field(s64, timestamp)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->rx = rx;
+		__entry->ry = ry;
+		__entry->rz = rz;
+		__entry->x = x;
+		__entry->y = y;
+		__entry->z = z;
+		__entry->timestamp = timestamp;
+	),
+
+	TP_printk("%s raw=%d,%d,%d out=%d,%d,%d ts=%lld", __get_str(name),
+		__entry->rx, __entry->ry, __entry->rz,
+		__entry->x, __entry->y, __entry->z, __entry->timestamp)
+);
+
+#endif /* _MMC3416X_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mmc3416x_trace
+#include <trace/define_trace.h>
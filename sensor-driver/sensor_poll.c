@@ -0,0 +1,263 @@
+/*
+ * Shared polling engine for sensors on one I2C adapter.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Every adapter with polled sensors gets one engine: an hrtimer armed for
+ * the earliest deadline and a single freezable worker that polls every
+ * sensor due in that wakeup, so their transfers go out back to back.
+ * Deadlines sit on a grid of multiples of the period in boottime, sensors
+ * with the same or harmonic periods therefore share their wakeups.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+
+#include "sensor_poll.h"
+
+/* sensors due this close to the wakeup are polled early with the rest */
+#define SENSOR_POLL_COALESCE_US	1000
+
+struct sensor_poll_engine {
+	struct list_head	node;
+	struct i2c_adapter	*adap;
+	int			users;
+	/* protects clients and is held while they are polled */
+	struct mutex		lock;
+	struct list_head	clients;
+	struct hrtimer		timer;
+	struct work_struct	work;
+	struct workqueue_struct	*wq;
+};
+
+static LIST_HEAD(sensor_poll_engines);
+static DEFINE_MUTEX(sensor_poll_mutex);
+
+/* Must be called with engine->lock held */
+static void sensor_poll_rearm(struct sensor_poll_engine *engine)
+{
+	struct sensor_poll_client *client;
+	bool armed = false;
+	ktime_t next = ktime_set(0, 0);
+
+	list_for_each_entry(client, &engine->clients, node) {
+		if (!client->active)
+			continue;
+		if (!armed || ktime_compare(client->next, next) < 0)
+			next = client->next;
+		armed = true;
+	}
+
+	if (armed)
+		hrtimer_start(&engine->timer, next, HRTIMER_MODE_ABS);
+	else
+		hrtimer_try_to_cancel(&engine->timer);
+}
+
+/* Move to the next slot after now, counting the slots that were missed */
+static void sensor_poll_advance(struct sensor_poll_client *client, ktime_t now)
+{
+	s64 period = ktime_to_ns(client->period);
+	s64 late;
+	u64 missed;
+
+	client->next = ktime_add(client->next, client->period);
+	late = ktime_to_ns(ktime_sub(now, client->next));
+	if (late < 0)
+		return;
+
+	missed = div64_u64(late, period) + 1;
+	client->next = ktime_add_ns(client->next, missed * period);
+	client->overruns += missed;
+}
+
+static void sensor_poll_work(struct work_struct *work)
+{
+	struct sensor_poll_engine *engine = container_of(work,
+			struct sensor_poll_engine, work);
+	struct sensor_poll_client *client;
+	ktime_t horizon;
+
+	mutex_lock(&engine->lock);
+
+	horizon = ktime_add_us(ktime_get_boottime(), SENSOR_POLL_COALESCE_US);
+	list_for_each_entry(client, &engine->clients, node) {
+		if (!client->active ||
+			ktime_compare(client->next, horizon) > 0)
+			continue;
+
+		client->deadline = client->next;
+		client->poll(client);
+		sensor_poll_advance(client, ktime_get_boottime());
+	}
+
+	sensor_poll_rearm(engine);
+	mutex_unlock(&engine->lock);
+}
+
+static enum hrtimer_restart sensor_poll_timer(struct hrtimer *timer)
+{
+	struct sensor_poll_engine *engine = container_of(timer,
+			struct sensor_poll_engine, timer);
+
+	/* the worker rearms the timer once the due sensors are polled */
+	queue_work(engine->wq, &engine->work);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Must be called with sensor_poll_mutex held */
+static struct sensor_poll_engine *sensor_poll_get(struct i2c_adapter *adap)
+{
+	struct sensor_poll_engine *engine;
+
+	list_for_each_entry(engine, &sensor_poll_engines, node) {
+		if (engine->adap == adap) {
+			engine->users++;
+			return engine;
+		}
+	}
+
+	engine = kzalloc(sizeof(*engine), GFP_KERNEL);
+	if (!engine)
+		return NULL;
+
+	engine->wq = alloc_workqueue("sensor_poll-%d",
+			WQ_FREEZABLE | WQ_UNBOUND | WQ_MEM_RECLAIM, 1,
+			i2c_adapter_id(adap));
+	if (!engine->wq) {
+		kfree(engine);
+		return NULL;
+	}
+
+	engine->adap = adap;
+	engine->users = 1;
+	mutex_init(&engine->lock);
+	INIT_LIST_HEAD(&engine->clients);
+	INIT_WORK(&engine->work, sensor_poll_work);
+	hrtimer_init(&engine->timer, CLOCK_BOOTTIME, HRTIMER_MODE_ABS);
+	engine->timer.function = sensor_poll_timer;
+	list_add_tail(&engine->node, &sensor_poll_engines);
+
+	return engine;
+}
+
+/* Must be called with sensor_poll_mutex held */
+static void sensor_poll_put(struct sensor_poll_engine *engine)
+{
+	if (--engine->users)
+		return;
+
+	list_del(&engine->node);
+	hrtimer_cancel(&engine->timer);
+	/* flushes a wakeup that was already queued */
+	destroy_workqueue(engine->wq);
+	kfree(engine);
+}
+
+/**
+ * sensor_poll_register - attach a sensor to the engine of its adapter
+ * @client: embedded client, stays inactive until sensor_poll_start()
+ * @adap: adapter the sensor sits on
+ * @poll: called from the engine's worker on every deadline
+ */
+int sensor_poll_register(struct sensor_poll_client *client,
+		struct i2c_adapter *adap,
+		void (*poll)(struct sensor_poll_client *client))
+{
+	struct sensor_poll_engine *engine;
+
+	mutex_lock(&sensor_poll_mutex);
+	engine = sensor_poll_get(adap);
+	mutex_unlock(&sensor_poll_mutex);
+	if (!engine)
+		return -ENOMEM;
+
+	client->engine = engine;
+	client->poll = poll;
+	client->active = false;
+
+	mutex_lock(&engine->lock);
+	list_add_tail(&client->node, &engine->clients);
+	mutex_unlock(&engine->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(sensor_poll_register);
+
+void sensor_poll_unregister(struct sensor_poll_client *client)
+{
+	struct sensor_poll_engine *engine = client->engine;
+
+	mutex_lock(&engine->lock);
+	client->active = false;
+	list_del(&client->node);
+	sensor_poll_rearm(engine);
+	mutex_unlock(&engine->lock);
+
+	mutex_lock(&sensor_poll_mutex);
+	sensor_poll_put(engine);
+	mutex_unlock(&sensor_poll_mutex);
+
+	client->engine = NULL;
+}
+EXPORT_SYMBOL_GPL(sensor_poll_unregister);
+
+/**
+ * sensor_poll_start - (re)start polling every @period_ms
+ *
+ * The first deadline is the next multiple of the period, which lines the
+ * sensor up with the others on the adapter. Restarting a running client
+ * moves it to the new grid and clears its overrun count.
+ */
+void sensor_poll_start(struct sensor_poll_client *client,
+		unsigned int period_ms)
+{
+	struct sensor_poll_engine *engine = client->engine;
+	s64 period = (s64)max(period_ms, 1U) * NSEC_PER_MSEC;
+	s64 now = ktime_to_ns(ktime_get_boottime());
+
+	mutex_lock(&engine->lock);
+	client->period = ns_to_ktime(period);
+	client->next = ns_to_ktime((div64_s64(now, period) + 1) * period);
+	client->overruns = 0;
+	client->active = true;
+	sensor_poll_rearm(engine);
+	mutex_unlock(&engine->lock);
+}
+EXPORT_SYMBOL_GPL(sensor_poll_start);
+
+/**
+ * sensor_poll_stop - stop polling
+ *
+ * Polls run under the engine lock, so once this returns poll() is neither
+ * running nor called again until the next sensor_poll_start().
+ */
+void sensor_poll_stop(struct sensor_poll_client *client)
+{
+	struct sensor_poll_engine *engine = client->engine;
+
+	mutex_lock(&engine->lock);
+	client->active = false;
+	sensor_poll_rearm(engine);
+	mutex_unlock(&engine->lock);
+}
+EXPORT_SYMBOL_GPL(sensor_poll_stop);
+
+MODULE_DESCRIPTION("Shared polling engine for I2C sensors");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,50 @@
+/*
+ * Shared polling engine for sensors on one I2C adapter.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SENSOR_POLL_H__
+#define __SENSOR_POLL_H__
+
+#include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+
+struct sensor_poll_engine;
+
+/*
+ * A periodically polled sensor, embedded in the driver's private data.
+ * poll() runs from the adapter's worker, deadline holds the slot it was
+ * scheduled for and overruns counts the slots skipped since the last
+ * sensor_poll_start() because the worker ran late.
+ */
+struct sensor_poll_client {
+	struct list_head		node;
+	struct sensor_poll_engine	*engine;
+	void				(*poll)(struct sensor_poll_client *client);
+	ktime_t				period;
+	ktime_t				next;
+	ktime_t				deadline;
+	u64				overruns;
+	bool				active;
+};
+
+int sensor_poll_register(struct sensor_poll_client *client,
+		struct i2c_adapter *adap,
+		void (*poll)(struct sensor_poll_client *client));
+void sensor_poll_unregister(struct sensor_poll_client *client);
+void sensor_poll_start(struct sensor_poll_client *client,
+		unsigned int period_ms);
+void sensor_poll_stop(struct sensor_poll_client *client);
+
+#endif /* __SENSOR_POLL_H__ */
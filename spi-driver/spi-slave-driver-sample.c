@@ -17,12 +17,52 @@
 #include <linux/spi/spi.h>
 #include <linux/of.h>
 #include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/cache.h>
  
 #define SPI_DRIVER_NAME "spi-slave-samp"
 
-#define SPI_MAX_TRANS_SIZE    (0x1 << 6)
+/* largest transfer buffer, whether DT or the controller sizes it */
+#define SPI_MAX_TRANS_SIZE    (4096 + 5)
+#define SPI_MIN_TRANS_SIZE    (0x1 << 6)
 #define MASK_8BIT 0xFF
 
+#define SAMP_SPI_WR	0xF0
+#define SAMP_SPI_RD	0xF1
+
+/* WR - REG_H - REG_L - RD ahead of read data */
+#define SAMP_READ_HDR	4
+/* WR - REG_H - REG_L - LEN_H - LEN_L ahead of write data */
+#define SAMP_WRITE_HDR	5
+
+/* older kernels only define it on architectures with non-coherent DMA */
+#ifndef ARCH_DMA_MINALIGN
+#define ARCH_DMA_MINALIGN	L1_CACHE_BYTES
+#endif
+
+struct samp_device {
+	struct device *dev;
+	/* serializes users of buf, xfers and msg */
+	struct mutex lock;
+	/*
+	 * kmalloc'ed, so DMA-safe. Reads keep their chunk headers at the
+	 * start and receive into rx, where every chunk starts and ends on an
+	 * ARCH_DMA_MINALIGN boundary so no two DMA buffers share a cacheline.
+	 */
+	u8 *buf;
+	u32 buf_size;
+	u8 *rx;
+	u32 rx_size;
+	/* longest single transfer and message the controller takes */
+	u32 max_xfer;
+	u32 max_msg;
+	/* read chunks chained into one message */
+	u32 max_chunks;
+	struct spi_transfer *xfers;
+	struct spi_message msg;
+};
+
 /**
  * samp_spi_read - read device register through spi bus
  * @dev: pointer to device data
@@ -32,60 +72,85 @@
  * @len: bytes to read
  * return: 0 - read ok, -EBUSERR - spi transter error
  * 0xF0 - REG_H - REG_L - 0xF1 - data
+ *
+ * Every chunk is an address phase, CS toggled, then the read command
+ * followed by the data. As many chunks as fit in the rx area and in the
+ * controller's message size limit are chained into one spi_message, so a
+ * frame costs as few spi_sync() calls as the controller allows.
 */
-static int samp_spi_read(struct samp_device *dev, u32 addr,
+static int __maybe_unused samp_spi_read(struct samp_device *dev, u32 addr,
 		u8 *data, u32 len) 
 {
 	struct spi_device *spi = to_spi_device(dev->dev);
-	struct spi_transfer xfers;
-	struct spi_message spi_msg;
-	u8 buffer[4 + SPI_MAX_TRANS_SIZE];
-	u32 remain, trans_len, offset = 0;
+	struct spi_transfer *xfers;
+	u32 chunk = min3(dev->rx_size, dev->max_xfer,
+			dev->max_msg - SAMP_READ_HDR);
+	u32 trans_len, pos, rx_pos, msg_len, i, offset = 0;
+	u8 *buffer;
 	int r = 0;
 
-	remain = len;
-	while (remain > 0) {
-		spi_message_init(&spi_msg);
-		memset(&xfers, 0x00, sizeof(xfers));
-		memset(&buffer[4], 0x00, SPI_MAX_TRANS_SIZE);
+	mutex_lock(&dev->lock);
+	while (offset < len) {
+		spi_message_init(&dev->msg);
+		memset(dev->xfers, 0x00,
+			3 * dev->max_chunks * sizeof(*dev->xfers));
+		xfers = dev->xfers;
 
-		/* set register address */
-		buffer[0] = SAMP_SPI_WR;
-		buffer[1] = ((addr + offset) >> 8) & MASK_8BIT;
-		buffer[2] = (addr + offset) & MASK_8BIT;
+		for (i = 0, pos = 0, rx_pos = 0, msg_len = 0;
+				i < dev->max_chunks && offset + pos < len;
+				i++, xfers += 3) {
+			trans_len = min(len - offset - pos, chunk);
+			if (rx_pos + ALIGN(trans_len, ARCH_DMA_MINALIGN) >
+					dev->rx_size ||
+				msg_len + SAMP_READ_HDR + trans_len > dev->max_msg)
+				break;
+			buffer = dev->buf + i * SAMP_READ_HDR;
 
-		xfers.tx_buf = buffer;
-		xfers.len = 3;
-		xfers.cs_change = 1;
-		spi_message_add_tail(&xfers, &spi_msg);
-		r = spi_sync(spi, &spi_msg);
-		if (r < 0) {
-			pr_err("Spi transfer error:%d\n",r);
-			return r;
+			/* set register address */
+			buffer[0] = SAMP_SPI_WR;
+			buffer[1] = ((addr + offset + pos) >> 8) & MASK_8BIT;
+			buffer[2] = (addr + offset + pos) & MASK_8BIT;
+			buffer[3] = SAMP_SPI_RD;
+
+			xfers[0].tx_buf = buffer;
+			xfers[0].len = 3;
+			xfers[0].cs_change = 1;
+			spi_message_add_tail(&xfers[0], &dev->msg);
+
+			xfers[1].tx_buf = &buffer[3];
+			xfers[1].len = 1;
+			spi_message_add_tail(&xfers[1], &dev->msg);
+
+			xfers[2].rx_buf = dev->rx + rx_pos;
+			xfers[2].len = trans_len;
+			/* release CS between chunks */
+			xfers[2].cs_change = 1;
+			spi_message_add_tail(&xfers[2], &dev->msg);
+
+			pos += trans_len;
+			rx_pos += ALIGN(trans_len, ARCH_DMA_MINALIGN);
+			msg_len += SAMP_READ_HDR + trans_len;
 		}
-		
-		spi_message_init(&spi_msg);
-		memset(&xfers, 0x00, sizeof(xfers));
-		buffer[3] = SAMP_SPI_RD;
-		trans_len = min(remain, SPI_MAX_TRANS_SIZE);
-		xfers.tx_buf = &buffer[3];
-		xfers.rx_buf = buffer;
-		xfers.len = 1 + trans_len;
-		xfers.cs_change = 1;
-		spi_message_add_tail(&xfers, &spi_msg);
-		r = spi_sync(spi, &spi_msg);
-		if (!r) {
-			memcpy(data + offset, &buffer[1], trans_len);
-			offset += trans_len;
-			remain -= trans_len;
-		} else {
+		/* the last one ends the message with CS released */
+		xfers[-1].cs_change = 0;
+
+		r = spi_sync(spi, &dev->msg);
+		if (r < 0) {
 			pr_err("Fialed to read: %04X len: %d, errno: %d\n",
-				addr + offset, trans_len, r);
+				addr + offset, pos, r);
 			break;
 		}
+
+		/* each chunk landed in its own region of the rx area */
+		xfers = dev->xfers;
+		while (i--) {
+			memcpy(data + offset, xfers[2].rx_buf, xfers[2].len);
+			offset += xfers[2].len;
+			xfers += 3;
+		}
 	}
+	mutex_unlock(&dev->lock);
 
-	//spi_message_free(spi_msg);
 	return r;
 }
 
@@ -99,38 +164,31 @@ static int samp_spi_read(struct samp_device *dev, u32 addr,
  * return: 0 - write ok, -EBUSERR - spi transter error
  * 0xF0 - REG_H - REG_L - 0xF1 - data
 */
-static int samp_spi_write(struct samp_ts_device *dev, u32 addr,
+static int __maybe_unused samp_spi_write(struct samp_device *dev, u32 addr,
 		u8 *data, u32 len)
 {	
 	struct spi_device *spi = to_spi_device(dev->dev);
-	struct spi_transfer xfers = {0};
-	struct spi_message spi_msg;
-	u8 buffer[5 + SPI_MAX_TRANS_SIZE];
+	struct spi_transfer *xfers = dev->xfers;
+	u8 *buffer = dev->buf;
+	u32 chunk = min3(dev->buf_size, dev->max_xfer, dev->max_msg) -
+			SAMP_WRITE_HDR;
 	u32 remain, trans_len, offset = 0;
 	int r = 0;
 
-/*
-	spi_msg = spi_message_alloc(1, GFP_KERNEL);
-	if (!spi_msg) {
-		ts_err("Failed to alloc memory for spi_msg");
-		return -ENOMEM;
-	}
-	xfers = (struct spi_transfer *)(spi_msg + 1);
-*/
+	mutex_lock(&dev->lock);
 
 	/* message init */
 	buffer[0] = SAMP_SPI_WR;
 	remain = len;
 	while (remain > 0) {
-		spi_message_init(&spi_msg);
-		memset(&xfers, 0x00, sizeof(xfers));
-
-		trans_len = min(remain, SPI_MAX_TRANS_SIZE);
-		memcpy(&buffer[5], data + offset, trans_len);
-		xfers.tx_buf = buffer;
-		xfers.len = 5 + trans_len;
-		xfers.cs_change = 1;
-		spi_message_add_tail(&xfers, &spi_msg);
+		spi_message_init(&dev->msg);
+		memset(xfers, 0x00, sizeof(*xfers));
+
+		trans_len = min(remain, chunk);
+		memcpy(&buffer[SAMP_WRITE_HDR], data + offset, trans_len);
+		xfers->tx_buf = buffer;
+		xfers->len = SAMP_WRITE_HDR + trans_len;
+		spi_message_add_tail(xfers, &dev->msg);
 		
 		/* set register address */
 		buffer[1] = ((addr + offset) >> 8) & MASK_8BIT;
@@ -138,21 +196,75 @@ static int samp_spi_write(struct samp_ts_device *dev, u32 addr,
 		buffer[3] = (trans_len >> 8) & MASK_8BIT;
 		buffer[4] = trans_len & MASK_8BIT;
 
-		r = spi_sync(spi, &spi_msg);
+		r = spi_sync(spi, &dev->msg);
 		if (!r) {
 			offset += trans_len;
 			remain -= trans_len;
 		} else {
-			pr_err("Fialed to read: %04X len: %d, errno: %d\n",
+			pr_err("Fialed to write: %04X len: %d, errno: %d\n",
 				addr + offset, trans_len, r);
 			break;
 		}
 	}
 
-	//spi_message_free(spi_msg);
+	mutex_unlock(&dev->lock);
 	return r;
 }
 
+/*
+ * Size the rx area from "samp,max-transfer-size" in DT, else from what the
+ * controller takes in one transfer. Either is capped at SPI_MAX_TRANS_SIZE.
+ * The read headers go in front of it, padded to ARCH_DMA_MINALIGN.
+ */
+static int samp_spi_init_buffer(struct samp_device *dev,
+		struct spi_device *spi)
+{
+	u32 size, chunk, hdr_size;
+
+	dev->max_xfer = min_t(size_t, spi_max_transfer_size(spi), U32_MAX);
+	dev->max_msg = min_t(size_t, spi_max_message_size(spi), U32_MAX);
+	if (of_property_read_u32(dev->dev->of_node,
+			"samp,max-transfer-size", &size)) {
+		size = min_t(u32, dev->max_xfer, SPI_MAX_TRANS_SIZE);
+	} else if (size > SPI_MAX_TRANS_SIZE) {
+		dev_warn(dev->dev, "max-transfer-size %u clamped to %u\n",
+			size, SPI_MAX_TRANS_SIZE);
+		size = SPI_MAX_TRANS_SIZE;
+	}
+
+	if (size < SPI_MIN_TRANS_SIZE || dev->max_xfer < SPI_MIN_TRANS_SIZE ||
+			dev->max_msg < SPI_MIN_TRANS_SIZE) {
+		dev_err(dev->dev, "transfer size %u/%u/%u too small\n",
+			size, dev->max_xfer, dev->max_msg);
+		return -EINVAL;
+	}
+	dev->rx_size = ALIGN(size, ARCH_DMA_MINALIGN);
+
+	/* full chunks that fit, plus a shorter tail */
+	chunk = min3(dev->rx_size, dev->max_xfer, dev->max_msg - SAMP_READ_HDR);
+	dev->max_chunks = dev->rx_size / ALIGN(chunk, ARCH_DMA_MINALIGN) + 1;
+	dev->xfers = devm_kcalloc(dev->dev, 3 * dev->max_chunks,
+			sizeof(*dev->xfers), GFP_KERNEL);
+	if (!dev->xfers)
+		return -ENOMEM;
+
+	/*
+	 * Plain kzalloc rather than devm: older devres only aligns its data
+	 * to 8 bytes, and the rx area must sit on a DMA boundary.
+	 */
+	hdr_size = ALIGN(dev->max_chunks * SAMP_READ_HDR, ARCH_DMA_MINALIGN);
+	dev->buf_size = hdr_size + dev->rx_size;
+	dev->buf = kzalloc(dev->buf_size, GFP_KERNEL);
+	if (!dev->buf)
+		return -ENOMEM;
+	dev->rx = dev->buf + hdr_size;
+
+	dev_info(dev->dev, "rx area %u bytes, controller limits %u/%u\n",
+		dev->rx_size, dev->max_xfer, dev->max_msg);
+
+	return 0;
+}
+
 /**
  * samp_spi_probe - driver probe spi slave device
  * 
@@ -168,12 +280,18 @@ static int samp_spi_probe(struct spi_device *spi)
 	spi_setup(spi);
 
 	samp_spi_dev = devm_kzalloc(&spi->dev,
-		sizeof(struct platform_device), GFP_KERNEL);
+		sizeof(*samp_spi_dev), GFP_KERNEL);
 	if (!samp_spi_dev) {
 		return -ENOMEM;
 	}
 
-	smap_spi_dev->dev = &spi->dev;
+	samp_spi_dev->dev = &spi->dev;
+	mutex_init(&samp_spi_dev->lock);
+
+	r = samp_spi_init_buffer(samp_spi_dev, spi);
+	if (r)
+		return r;
+
 	spi_set_drvdata(spi, samp_spi_dev);
 
 	return r;
@@ -181,7 +299,10 @@ static int samp_spi_probe(struct spi_device *spi)
 
 static int samp_spi_remove(struct spi_device *device)
 {
-	struct platform_device *pdev = spi_get_drvdata(device);
+	struct samp_device *samp_spi_dev = spi_get_drvdata(device);
+
+	kfree(samp_spi_dev->buf);
+	mutex_destroy(&samp_spi_dev->lock);
 	return 0;
 }
 
@@ -206,19 +327,18 @@ static struct spi_driver samp_spi_driver = {
 #endif
 	},
 	.probe = samp_spi_probe,
-	.remove = googdix_boston_spi_remove,
+	.remove = samp_spi_remove,
 	.id_table = spi_id_table,
 };
 
 static int __init samp_spi_init(void)
 {
-	spi_register_driver(&samp_spi_driver);
-	return 0;
+	return spi_register_driver(&samp_spi_driver);
 }
 
 static void __exit samp_spi_exit(void)
 {
-	return;
+	spi_unregister_driver(&samp_spi_driver);
 }
 
 module_init(samp_spi_init);